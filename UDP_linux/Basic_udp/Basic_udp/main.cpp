@@ -1,6 +1,6 @@
 #include "common.h"
 
-constexpr const char* Available_commands = "Available commands:\nlist\nban <slot>\nexit\n";
+constexpr const char* Available_commands = "Available commands:\nlist\nban <slot>\nstats\nexit\n";
 
 void master(Server& server)
 {
@@ -18,6 +18,11 @@ void master(Server& server)
 			std::string list = server.get_clients();
 			printf("Current connections:\n%s", list.c_str());
 		}
+		else if (command == "stats")
+		{
+			std::string stats = server.get_stats();
+			printf("%s", stats.c_str());
+		}
 		else if (command.find("ban") != std::string::npos)
 		{
 			int32 number = std::stoi(command.substr(4, command.size() - 4));
@@ -39,36 +44,65 @@ void master(Server& server)
 	}
 }
 
+void handle(const Input_message& message)
+{
+	std::string str = "Received " + message.message + " from " + message.address.to_string() + "\n";
+	printf(str.c_str());
+}
+
 void logic(Server& server)
 {
 	while (server.running())
 	{
-		if (server.has_message())
+		if (server.wait_message(Time{ 1000 }))
 		{
-			auto message = server.next_message();
-			std::string str = "Received " + std::string(message.message.message) + " from " + message.address.to_string() + "\n";
-			printf(str.c_str());
+			handle(server.next_message());
 		}
-
-		server.wait_ms(Time{ 50 });
 	}
 }
 
 int main(int argc, char* argv[])
 {
+	Server_config config;
+	if (!parse_arguments(argc, argv, config)) return 1;
+
 	Server server;
-	server.start(true);
+	server.start(true, config);
+
+	if (config.event_loop)
+	{
+		std::vector<std::thread> shard_threads;
+		for (int32 i = 1; i < server.shard_count(); ++i)
+		{
+			shard_threads.emplace_back([&, i] {server.event_loop(handle, i); });
+		}
+		std::thread master_thread([&] {master(server); });
+		printf(Available_commands);
+
+		server.event_loop(handle);
+
+		for (auto& thread : shard_threads) thread.join();
+		master_thread.join();
+
+		printf("Press any key to exit...");
+		std::cin.get();
 
-	std::thread listen_thread([&] {server.listen_thread(); });
-	std::thread resend_thread([&] {server.resend_thread(); });
+		return 0;
+	}
+
+	std::vector<std::thread> network_threads;
+	for (int32 i = 0; i < server.shard_count(); ++i)
+	{
+		network_threads.emplace_back([&, i] {server.listen_thread(i); });
+		network_threads.emplace_back([&, i] {server.resend_thread(i); });
+	}
 	std::thread logic_thread([&] {logic(server); });
 	std::thread master_thread([&] {master(server); });
 	printf(Available_commands);
 
 	// server.debug_drop_next_input_package = true;
 
-	listen_thread.join();
-	resend_thread.join();
+	for (auto& thread : network_threads) thread.join();
 	logic_thread.join();
 	master_thread.join();
 
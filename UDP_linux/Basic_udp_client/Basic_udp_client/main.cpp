@@ -1,6 +1,21 @@
 #include "common.h"
 
-constexpr const char* Available_commands = "Available commands:\nlist\nsay <message>\nexit\n";
+constexpr const char* Available_commands = "Available commands:\nlist\nsay <message>\nupdate <message>\nbench <count>\nstats\nexit\n";
+
+// pushes count messages through the send window and times them until the last one is acknowledged
+void bench(Server& server, int32 count)
+{
+	Address address{ "127.0.0.1", Network_port };
+	Time start = server.monotonic_ms();
+	for (int32 i = 0; i < count && server.running(); ++i)
+	{
+		while (server.send(address, "bench " + std::to_string(i)) == Send_result::Would_block) server.wait_ms(1);
+	}
+	while (server.in_flight() > 0 && server.running()) server.wait_ms(1);
+
+	Time elapsed = std::max<Time>(server.monotonic_ms() - start, 1);
+	printf("Sent %d messages in %" PRIu64 " ms, %" PRIu64 " per second\n", count, elapsed, count * 1000 / elapsed);
+}
 
 void master(Server& server)
 {
@@ -21,10 +36,30 @@ void master(Server& server)
 		else if (command.find("say") != std::string::npos)
 		{
 			std::string msg = command.substr(4, command.size() - 4);
-			Address address;
-			address.hostname = "127.0.0.1";
-			address.port = Network_port;
-			server.send(address, msg);
+			Address address{ "127.0.0.1", Network_port };
+			if (server.send(address, msg) == Send_result::Would_block)
+			{
+				printf("Server is not keeping up, message dropped\n");
+			}
+		}
+		else if (command.find("update") == 0)
+		{
+			// latest state only, a lost update is not resent
+			std::string msg = command.substr(7, command.size() - 7);
+			Address address{ "127.0.0.1", Network_port };
+			if (server.send(address, msg, Delivery::Unreliable_sequenced) == Send_result::Would_block)
+			{
+				printf("Not connected yet, update dropped\n");
+			}
+		}
+		else if (command.find("bench") == 0)
+		{
+			bench(server, std::stoi(command.substr(6, command.size() - 6)));
+		}
+		else if (command == "stats")
+		{
+			std::string stats = server.get_stats();
+			printf("%s", stats.c_str());
 		}
 		else if (command == "exit")
 		{
@@ -38,25 +73,56 @@ void master(Server& server)
 	}
 }
 
+void handle(const Input_message& message)
+{
+	std::string str = "Received " + message.message + " from " + message.address.to_string() + "\n";
+	printf(str.c_str());
+}
+
+void report_ready(Server& server)
+{
+	Address ready;
+	while (server.send_ready(&ready, 1) > 0)
+	{
+		printf("Server is keeping up again\n");
+	}
+}
+
 void logic(Server& server)
 {
 	while (server.running())
 	{
-		if (server.has_message())
+		bool has_message = server.wait_message(Time{ 1000 });
+		report_ready(server);
+		if (has_message)
 		{
-			auto message = server.next_message();
-			std::string str = "Received " + std::string(message.message.message) + " from " + message.address.to_string() + "\n";
-			printf(str.c_str());
+			handle(server.next_message());
 		}
-
-		server.wait_ms(Time{ 50 });
 	}
 }
 
 int main(int argc, char* argv[])
 {
+	Server_config config;
+	if (!parse_arguments(argc, argv, config)) return 1;
+
 	Server server;
-	server.start(false);
+	server.start(false, config);
+
+	if (config.event_loop)
+	{
+		std::thread master_thread([&] {master(server); });
+		printf(Available_commands);
+
+		server.event_loop(handle, 0, [&] { report_ready(server); });
+
+		master_thread.join();
+
+		printf("Press any key to exit...");
+		std::cin.get();
+
+		return 0;
+	}
 
 	std::thread listen_thread([&] {server.listen_thread(); });
 	std::thread resend_thread([&] {server.resend_thread(); });
@@ -2,10 +2,22 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <endian.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/random.h>
+#include <linux/io_uring.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 
 #include <string.h>
@@ -15,23 +27,106 @@
 #include <thread>
 #include <cassert>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <chrono>
 #include <algorithm>
+#include <functional>
+#include <memory>
+#include <deque>
 #include <iostream>
 
 using int32 = int32_t;
+using uint16 = uint16_t;
 using uint32 = uint32_t;
 using uint64 = uint64_t;
 using Socket = int32;
-using Package_number = int32;
+using Package_number = uint32;
 using Time = uint64;
+using Connection_handle = int32;
+
+// serial number arithmetic as in RFC 1982, right across the 2^32 wrap while numbers stay within 2^31 of each other
+inline int32 sequence_distance(Package_number from, Package_number to)
+{
+	return int32(to - from);
+}
+
+inline bool sequence_before(Package_number a, Package_number b)
+{
+	return sequence_distance(b, a) < 0;
+}
+
+inline int32 round_up_power_of_two(int32 value)
+{
+	int32 result = 1;
+	while (result < value) result <<= 1;
+	return result;
+}
+
+// SipHash-2-4, a keyed hash short inputs can be authenticated with
+inline uint64 siphash(const uint64 key[2], const char* data, int32 size)
+{
+	uint64 v0 = 0x736f6d6570736575ull ^ key[0];
+	uint64 v1 = 0x646f72616e646f6dull ^ key[1];
+	uint64 v2 = 0x6c7967656e657261ull ^ key[0];
+	uint64 v3 = 0x7465646279746573ull ^ key[1];
+
+	auto rotate = [](uint64 x, int32 bits) { return (x << bits) | (x >> (64 - bits)); };
+	auto round = [&]()
+	{
+		v0 += v1; v1 = rotate(v1, 13); v1 ^= v0; v0 = rotate(v0, 32);
+		v2 += v3; v3 = rotate(v3, 16); v3 ^= v2;
+		v0 += v3; v3 = rotate(v3, 21); v3 ^= v0;
+		v2 += v1; v1 = rotate(v1, 17); v1 ^= v2; v2 = rotate(v2, 32);
+	};
+
+	int32 whole = size & ~7;
+	for (int32 i = 0; i < whole; i += 8)
+	{
+		uint64 word;
+		bcopy(data + i, &word, sizeof(word));
+		word = le64toh(word);
+		v3 ^= word;
+		round();
+		round();
+		v0 ^= word;
+	}
+
+	uint64 last = uint64(size) << 56;
+	for (int32 i = whole; i < size; ++i) last |= uint64(uint8_t(data[i])) << (8 * (i - whole));
+	v3 ^= last;
+	round();
+	round();
+	v0 ^= last;
+
+	v2 ^= 0xff;
+	for (int32 i = 0; i < 4; ++i) round();
+	return v0 ^ v1 ^ v2 ^ v3;
+}
 
 constexpr int32 Network_port = 5001;
 constexpr int32 Message_size_limit = 1024;
+// independently ordered streams per connection, 0 is the default
+constexpr int32 Stream_limit = 16;
 
-constexpr Time Acknowledge_timeout_ms = 5000;
+// until the first round trip is measured
+constexpr Time Acknowledge_timeout_ms = 1000;
 
-constexpr const char* Acknowledge_prefix = "!ACK";
+constexpr int32 Receive_batch_limit = 1024;
+// packages in flight per connection, the send ring rounds it up to a power of two
+constexpr int32 Send_window_limit = 1 << 16;
+
+constexpr uint32 Uring_queue_depth = 256;
+constexpr int32 Uring_send_slots = 128;
+
+constexpr int32 Shard_limit = 64;
+// per-source token buckets in each shard, a power of two
+constexpr int32 Rate_bucket_count = 4096;
+
+// packages past the cumulative acknowledge that one acknowledge can report
+constexpr int32 Acknowledge_mask_bits = 64;
+// in order packages a delayed acknowledge may cover before it is sent at once
+constexpr int32 Delayed_acknowledge_limit = 4;
 
 
 std::vector<std::string> Split(const std::string& s, char seperator, bool handle_quotes = false, bool remove_quotes = false)
@@ -90,436 +185,3938 @@ std::vector<std::string> Split(const std::string& s, char seperator, bool handle
 	return output;
 }
 
+// payload storage, only the first length bytes are meaningful
 struct Message
 {
 	int32 length{ 0 };
-	char message[Message_size_limit + 1] = { 0 };
+	char message[Message_size_limit + 1];
 };
 
+// binary socket address, text is only produced for display
 struct Address
 {
-	std::string hostname;
-	int32 port{ 0 };
+	Address() {}
+
+	Address(const std::string& hostname, int32 port)
+	{
+		addr.sin_family = AF_INET;
+		inet_pton(AF_INET, hostname.c_str(), &addr.sin_addr);
+		addr.sin_port = htons(port);
+	}
+
+	explicit Address(const sockaddr_in& addr) : addr(addr) {}
+
+	sockaddr_in addr = { 0 };
+	int32 shard{ -1 }; // receiving shard, routes replies without a lookup
+
+	std::string hostname() const
+	{
+		char buffer[INET_ADDRSTRLEN];
+		return inet_ntop(AF_INET, &addr.sin_addr, buffer, INET_ADDRSTRLEN);
+	}
+
+	int32 port() const { return ntohs(addr.sin_port); }
 
 	std::string to_string() const
 	{
-		return hostname + ":" + std::to_string(port);
+		return hostname() + ":" + std::to_string(port());
 	}
 
-	bool operator==(const Address& other)
+	bool operator==(const Address& other) const
 	{
-		return hostname == other.hostname &&
-			port == other.port;
+		return addr.sin_addr.s_addr == other.addr.sin_addr.s_addr &&
+			addr.sin_port == other.addr.sin_port;
 	}
 
-	bool operator!=(const Address& other)
+	bool operator!=(const Address& other) const
 	{
 		return !operator==(other);
 	}
 };
 
+// a whole message, reassembled when it arrived in fragments
 struct Input_message
 {
 	Address address;
-	Message message;
+	std::string message;
 };
 
-struct Package
+// bounded lock-free queue, every slot carries a sequence telling whose turn it is
+template <typename T>
+class Ring
 {
-	Package_number number;
-	Message message;
+public:
+	Ring() {}
+	Ring(const Ring&) = delete;
+
+	void allocate(int32 capacity)
+	{
+		assert(capacity >= 2 && (capacity & (capacity - 1)) == 0);
+
+		cells.reset(new Cell[capacity]);
+		mask = capacity - 1;
+		for (int32 i = 0; i < capacity; ++i) cells[i].sequence.store(i, std::memory_order_relaxed);
+		enqueue_position.store(0, std::memory_order_relaxed);
+		dequeue_position.store(0, std::memory_order_relaxed);
+	}
 
-	void deserialize(const char buffer[sizeof(number) + sizeof(message)])
+	// value is consumed only when the push succeeds
+	bool try_push(T&& value)
 	{
-		bzero(&message.message, sizeof(message.message));
+		Cell* cell;
+		uint64 position = enqueue_position.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			cell = &cells[position & mask];
+			int64_t difference = (int64_t)cell->sequence.load(std::memory_order_acquire) - (int64_t)position;
+			if (difference == 0)
+			{
+				if (enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+			}
+			else if (difference < 0) return false; // full
+			else position = enqueue_position.load(std::memory_order_relaxed);
+		}
+
+		cell->value = std::move(value);
+		cell->sequence.store(position + 1, std::memory_order_release);
+		return true;
+	}
 
-		int32 off = 0;
-		bcopy((char*)buffer, (char*)this, sizeof(number));
-		off += sizeof(number);
-		bcopy((char*)buffer + off, (char*)this + off, sizeof(message.length));
-		off += sizeof(message.length);
-		bcopy((char*)buffer + off, (char*)this + off, message.length);
+	bool try_pop(T& out)
+	{
+		Cell* cell;
+		uint64 position = dequeue_position.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			cell = &cells[position & mask];
+			int64_t difference = (int64_t)cell->sequence.load(std::memory_order_acquire) - (int64_t)(position + 1);
+			if (difference == 0)
+			{
+				if (dequeue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+			}
+			else if (difference < 0) return false; // empty
+			else position = dequeue_position.load(std::memory_order_relaxed);
+		}
 
+		out = std::move(cell->value);
+		cell->sequence.store(position + mask + 1, std::memory_order_release);
+		return true;
 	}
 
-	void serialize(char buffer[sizeof(number) + sizeof(message)], int32& out_size)
+	// approximate while producers and consumers are running
+	int32 size() const
 	{
-		int32 off = 0;
-		bcopy((char*)this, (char*)buffer, sizeof(number));
-		off += sizeof(number);
-		bcopy((char*)this + off, (char*)buffer + off, sizeof(message.length));
-		off += sizeof(message.length);
-		bcopy((char*)this + off, (char*)buffer + off, message.length);
+		uint64 enqueued = enqueue_position.load(std::memory_order_acquire);
+		uint64 dequeued = dequeue_position.load(std::memory_order_acquire);
+		return enqueued > dequeued ? enqueued - dequeued : 0;
+	}
 
-		out_size = sizeof(number) + sizeof(message.length) + message.length;
+	// exact for the single consumer, a claimed but unwritten cell still counts as empty
+	bool empty() const
+	{
+		uint64 position = dequeue_position.load(std::memory_order_acquire);
+		return (int64_t)cells[position & mask].sequence.load(std::memory_order_acquire) - (int64_t)(position + 1) < 0;
 	}
+
+	int32 capacity() const { return mask + 1; }
+
+private:
+	struct Cell
+	{
+		std::atomic<uint64> sequence{ 0 };
+		T value;
+	};
+
+	std::unique_ptr<Cell[]> cells;
+	uint64 mask{ 0 };
+
+	// producers and consumers each get their own cache line
+	alignas(64) std::atomic<uint64> enqueue_position{ 0 };
+	alignas(64) std::atomic<uint64> dequeue_position{ 0 };
 };
 
-struct Connection
+enum class Package_type : int32
 {
-	bool banned{ false };
-	Address address;
-	int32 number_send{ 0 };
-	int32 number_receive{ 0 };
+	Data,
+	// a slice of a message longer than Message_size_limit, the last slice is sent as Data
+	Fragment,
+	// number is the next package expected, the payload a mask of the ones received past it
+	Acknowledge,
+	// a whole message delivered as soon as it arrives, still acknowledged and retransmitted
+	Unordered,
+	// numbered apart from the reliable packages, never acknowledged, older ones than the last delivered are dropped
+	Sequenced,
+	// asks an unknown peer for a cookie, a Cookie_payload with only the incarnation set
+	Hello,
+	// a Cookie_payload, sent back to a Hello and then echoed in front of the first datagrams
+	Cookie,
+	// probes a quiet peer, answered with an acknowledge
+	Keepalive,
+	// answers a package from a peer we hold no connection for, header only so it is never larger than what it answers
+	Reset
+};
+
+enum class Delivery
+{
+	// retransmitted until acknowledged, delivered in send order
+	Reliable_ordered,
+	// retransmitted until acknowledged, delivered on arrival, longer messages keep the order of their fragments
+	Reliable_unordered,
+	// sent once, stale ones are dropped, must fit a single package, refused until the handshake finishes
+	Unreliable_sequenced
+};
 
-	std::vector<std::pair<Package, Time>> send_sessions;
+// on the wire ahead of every payload, little-endian and unpadded
+#pragma pack(push, 1)
+struct Wire_header
+{
+	uint32 number;
+	uint16 type;
+	uint16 length;
 };
 
-class Server
+// follows the Wire_header of a Data or Fragment package whose type has Streamed_type set
+struct Stream_header
 {
-public:
-	Server() {}
-	Server(const Server&) = delete;
-	~Server() {}
+	uint16 stream;
+	uint16 sequence;
+};
 
-	bool start(bool is_server)
-	{
-		assert(state == State::None);
+// proves the peer receives at its address, mac is keyed over the address, the slot and the incarnation
+struct Cookie_payload
+{
+	uint32 slot;
+	// picked by the side that opens the connection, a new one tells the other side it started over
+	uint32 incarnation;
+	uint64 mac;
+};
+#pragma pack(pop)
 
-		this->is_server = is_server;
+static_assert(sizeof(Wire_header) == 8, "the wire header is 8 bytes");
+static_assert(sizeof(Stream_header) == 4, "the stream header is 4 bytes");
 
-		address_server.hostname = "127.0.0.1";
-		address_server.port = Network_port;
+constexpr uint16 Streamed_type = 0x8000;
 
-		socket_server = socket(AF_INET, SOCK_DGRAM, 0);
-		if (socket_server < 0)
-		{
-			printf("Failed to open server socket");
-			return false;
-		}
+// a package parsed in place, payload points into the buffer it came from
+struct Package_view
+{
+	static constexpr int32 Header_size = sizeof(Wire_header);
 
-		sockaddr_in addr_server = { 0 };
-		addr_server.sin_family = AF_INET;
-		addr_server.sin_addr.s_addr = INADDR_ANY;
-		addr_server.sin_port = htons(address_server.port);
+	Package_number number{ 0 };
+	Package_type type{ Package_type::Data };
+	const char* payload{ nullptr };
+	int32 length{ 0 };
+	// ordered packages count per stream, the header only goes out once the sender used a stream past 0
+	bool streamed{ false };
+	uint16 stream{ 0 };
+	uint16 stream_sequence{ 0 };
 
-		int32 level = 1;
-		auto setsockopt_result = setsockopt(socket_server, SOL_SOCKET, SO_BROADCAST, &level, sizeof(level));
-		if (setsockopt_result < 0)
-		{
-			printf("Failed to setsockopt server socket");
-			close(socket_server);
-			return false;
-		}
+	// returns the bytes taken from the buffer, 0 when they do not hold a well formed package
+	int32 parse(const char* buffer, int32 size)
+	{
+		if (size < Header_size) return 0;
 
-		if (is_server)
+		Wire_header header;
+		bcopy(buffer, &header, sizeof(header));
+		number = le32toh(header.number);
+		uint16 wire_type = le16toh(header.type);
+		length = le16toh(header.length);
+
+		streamed = (wire_type & Streamed_type) != 0;
+		wire_type &= ~Streamed_type;
+		if (wire_type > uint16(Package_type::Reset)) return 0;
+		type = Package_type(wire_type);
+
+		int32 extension = 0;
+		stream = 0;
+		stream_sequence = 0;
+		if (streamed)
 		{
-			auto result_bind = bind(socket_server, (sockaddr*)&addr_server, sizeof(addr_server));
-			if (result_bind < 0)
-			{
-				printf("Failed to bind server socket");
-				close(socket_server);
-				return false;
-			}
+			if (type != Package_type::Data && type != Package_type::Fragment) return 0;
+			extension = sizeof(Stream_header);
+			if (size < Header_size + extension) return 0;
+
+			Stream_header stream_header;
+			bcopy(buffer + Header_size, &stream_header, sizeof(stream_header));
+			stream = le16toh(stream_header.stream);
+			stream_sequence = le16toh(stream_header.sequence);
+			if (stream >= Stream_limit) return 0;
 		}
+		if (length > Message_size_limit || length > size - Header_size - extension) return 0;
 
-		state = State::Started;
+		payload = buffer + Header_size + extension;
+		return Header_size + extension + length;
+	}
 
-		return true;
+	int32 size() const
+	{
+		return Header_size + (streamed ? sizeof(Stream_header) : 0) + length;
 	}
 
-	bool running() const { return state == State::Started; }
+	// rewrites the number of an already serialized package
+	static void renumber(char* buffer, Package_number number)
+	{
+		uint32 wire_number = htole32(uint32(number));
+		bcopy(&wire_number, buffer + offsetof(Wire_header, number), sizeof(wire_number));
+	}
 
-	void terminate()
+	// rewrites the stream sequence of an already serialized package, it should be streamed
+	static void resequence(char* buffer, uint16 sequence)
 	{
-		if (state == State::Started)
-		{
-			state = State::Terminated;
-			terminated = true;
-			shutdown(socket_server, 2);
-			close(socket_server);
-			socket_server = -1;
-			printf("Server terminated\n");
-		}
+		uint16 wire_sequence = htole16(sequence);
+		bcopy(&wire_sequence, buffer + Header_size + offsetof(Stream_header, sequence), sizeof(wire_sequence));
 	}
 
-	std::string get_clients()
+	// buffer needs size() bytes, returns how many were written
+	int32 serialize(char* buffer) const
 	{
-		std::string result;
-		{
-			std::lock_guard<std::mutex> _(shared.mutex);
+		Wire_header header;
+		header.number = htole32(uint32(number));
+		header.type = htole16(uint16(type) | (streamed ? Streamed_type : 0));
+		header.length = htole16(uint16(length));
+		bcopy(&header, buffer, sizeof(header));
 
-			for (int32 i = 0; i < shared.connections.size(); ++i)
-			{
-				auto connection = shared.connections[i];
-				result += "#" + std::to_string(i) + " at " + connection.address.to_string();
-				if (connection.banned) result += " (banned)";
-				result += "\n";
-			}
+		int32 extension = 0;
+		if (streamed)
+		{
+			Stream_header stream_header;
+			stream_header.stream = htole16(stream);
+			stream_header.sequence = htole16(stream_sequence);
+			bcopy(&stream_header, buffer + Header_size, sizeof(stream_header));
+			extension = sizeof(stream_header);
 		}
-		return result;
+		if (length > 0) bcopy(payload, buffer + Header_size + extension, length);
+		return Header_size + extension + length;
 	}
+};
 
-	bool ban_client(int32 slot)
+enum class Send_result
+{
+	// handed to the socket and tracked for retransmission
+	Sent,
+	// the send window is full, goes out once acknowledges make room
+	Queued,
+	// the send queue is full as well, or an unreliable message came before the handshake finished
+	// the message was not taken, send_ready reports the peer once a retry can go out
+	Would_block,
+	// longer than message_limit, or than a package when unreliable, never taken
+	Too_large,
+	// the stream is not below Stream_limit, the peer would reject every package of it
+	Bad_stream,
+	// the connection table is at its limit with banned peers only, nothing could be evicted for a new one
+	Table_full
+};
+
+// largest datagram sent or received, an Ethernet MTU less the IP and UDP headers
+constexpr int32 Datagram_limit = 1472;
+static_assert(Package_view::Header_size + sizeof(Stream_header) + Message_size_limit <= Datagram_limit, "a package should fit in one datagram");
+
+// slab allocator for serialized outbound packages, each rounded up to the nearest size class
+class Packet_pool
+{
+public:
+	static constexpr int32 Class_count = 6;
+	static constexpr int32 Class_sizes[Class_count] = { 64, 128, 256, 512, 1024, Datagram_limit };
+	static constexpr int32 Slab_bytes = 64 * 1024;
+	static constexpr int32 Index_bits = 24;
+	// fully free slabs each class keeps through a trim
+	static constexpr int32 Spare_slabs = 1;
+
+	// the size class in the top bits, the block within the class below
+	using Handle = int32;
+
+	Handle allocate(int32 size)
 	{
-		{
-			std::lock_guard<std::mutex> _(shared.mutex);
+		int32 index = 0;
+		while (Class_sizes[index] < size) ++index;
 
-			if (slot < 0 || slot >= shared.connections.size()) return false;
-			shared.connections[slot].banned = true;
-			return true;
-		}
+		Size_class& size_class = classes[index];
+		if (size_class.free.empty()) grow(index);
 
-		return false;
+		int32 block = size_class.free.back();
+		size_class.free.pop_back();
+		++size_class.used[block / size_class.blocks_per_slab()];
+
+		bytes_in_use += size_class.block_size();
+		high_water = std::max(high_water, bytes_in_use);
+		++buffers_in_use;
+		return (index << Index_bits) | block;
 	}
 
-	void resend_thread()
+	void release(Handle handle)
 	{
-		assert(state == State::Started);
+		Size_class& size_class = classes[handle >> Index_bits];
+		int32 block = handle & ((1 << Index_bits) - 1);
+		size_class.free.push_back(block);
+		--size_class.used[block / size_class.blocks_per_slab()];
 
-		while (!terminated)
+		bytes_in_use -= size_class.block_size();
+		--buffers_in_use;
+	}
+
+	char* data(Handle handle)
+	{
+		Size_class& size_class = classes[handle >> Index_bits];
+		int32 block = handle & ((1 << Index_bits) - 1);
+		int32 per_slab = size_class.blocks_per_slab();
+		return size_class.slabs[block / per_slab].get() + (block % per_slab) * size_class.block_size();
+	}
+
+	// returns fully free slabs past the spares to the system, handles in use stay valid
+	void trim()
+	{
+		for (auto& size_class : classes)
 		{
+			int32 spare = 0;
+			bool trimmed = false;
+			for (int32 i = 0; i < size_class.slabs.size(); ++i)
 			{
-				std::lock_guard<std::mutex> _(shared.mutex);
-				for (auto& connection : shared.connections)
-				{
-					for (auto& session : connection.send_sessions)
-					{
-						if (time_ms() - session.second >= Acknowledge_timeout_ms)
-						{
-							printf(("Package " + std::to_string(session.first.number) + " to " + connection.address.to_string() + " was not acknowledged within timeout, resending\n").c_str());
-
-							send_immediate(connection.address, session.first);
-							session.second = time_ms();
-						}
-					}
-				}
+				if (!size_class.slabs[i] || size_class.used[i] > 0 || ++spare <= Spare_slabs) continue;
+				size_class.slabs[i].reset();
+				trimmed = true;
 			}
+			if (!trimmed) continue;
 
-			wait_ms(Time{ 100 });
+			int32 per_slab = size_class.blocks_per_slab();
+			auto released = [&](int32 block) { return !size_class.slabs[block / per_slab]; };
+			size_class.free.erase(std::remove_if(size_class.free.begin(), size_class.free.end(), released), size_class.free.end());
 		}
 	}
 
-	void listen_thread()
+	int64_t reserved() const
 	{
-		while (!terminated)
+		int64_t total = 0;
+		for (auto& size_class : classes)
 		{
-			char buffer[sizeof(Package)];
+			for (auto& slab : size_class.slabs) if (slab) total += Slab_bytes;
+		}
+		return total;
+	}
 
-			sockaddr_in addr = { 0 };
-			uint32 addr_size = sizeof(addr);
+	int32 buffers_in_use{ 0 };
+	int64_t bytes_in_use{ 0 };
+	int64_t high_water{ 0 };
 
-			int32 n = recvfrom(socket_server, buffer, sizeof(buffer), 0, (sockaddr*)&addr, &addr_size);
-			if (n <= 0) break;
+private:
+	struct Size_class
+	{
+		int32 size_index{ 0 };
+		// a trimmed slab is null until the class grows into it again
+		std::vector<std::unique_ptr<char[]>> slabs;
+		// blocks handed out from each slab
+		std::vector<int32> used;
+		std::vector<int32> free;
 
-			Package package;
-			package.deserialize(buffer);
+		int32 block_size() const { return Class_sizes[size_index]; }
+		int32 blocks_per_slab() const { return Slab_bytes / block_size(); }
+	};
 
-			Address address;
-			address.hostname = inet_ntop(AF_INET, &addr.sin_addr, buffer, INET_ADDRSTRLEN);
-			address.port = ntohs(addr.sin_port);
+	void grow(int32 index)
+	{
+		Size_class& size_class = classes[index];
+		size_class.size_index = index;
 
+		// a trimmed slab keeps its place, so the block numbers of the others do not move
+		int32 slab = 0;
+		while (slab < size_class.slabs.size() && size_class.slabs[slab]) ++slab;
+		if (slab == size_class.slabs.size())
+		{
+			size_class.slabs.emplace_back();
+			size_class.used.push_back(0);
+		}
+		size_class.slabs[slab].reset(new char[Slab_bytes]);
 
-			{
-				std::lock_guard<std::mutex> _(shared.mutex);
+		int32 per_slab = size_class.blocks_per_slab();
+		int32 first = slab * per_slab;
+		// handed out from the front of the slab first
+		for (int32 i = per_slab - 1; i >= 0; --i) size_class.free.push_back(first + i);
+	}
 
-				Connection& connection = obtain_connection(address);
-				bool skip = false;
-				if (debug_drop_next_input_package)
-				{
-					skip = true;
-					debug_drop_next_input_package = false;
-				}
-				if (connection.banned || skip)
-				{
-					printf("Dropping package from %s\n", address.to_string().c_str());
-				}
-				else
-				{
-					printf("Processing package from %s\n", address.to_string().c_str());
+	Size_class classes[Class_count];
+};
 
-					bool is_message_acknowledge =
-						package.message.length == strlen(Acknowledge_prefix) &&
-						bcmp(Acknowledge_prefix, package.message.message, strlen(Acknowledge_prefix)) == 0;
+// one package in flight or queued for the send window
+struct Send_session
+{
+	Package_number number{ 0 };
+	// the serialized package in the shard's packet pool
+	Packet_pool::Handle buffer{ -1 };
+	int32 size{ 0 };
+	int32 timer{ -1 };
+	Time sent_us{ 0 };
+	int32 retransmits{ 0 };
+	// false for the fragments after the first, a connection that starts over only resends whole messages
+	bool starts_message{ true };
+};
 
-					if (is_message_acknowledge)
-					{
-						auto& sessions = connection.send_sessions;
-						auto it = std::find_if(sessions.begin(), sessions.end(), [&](std::pair<Package, Time> it) {return it.first.number == package.number; });
-						if (it == sessions.end())
-						{
-							printf("No package to acknowledge with number #%s\n", std::to_string(package.number).c_str());
-						}
-						else
-						{
-							sessions.erase(it);
-							printf("Acknowledged package with number #%s\n", std::to_string(package.number).c_str());
-						}
-					}
-					else
-					{
-						bool ack = false;
-						bool push = false;
-
-						if (package.number > connection.number_receive)
-						{
-							printf("Dropping package #%s, next package number is #%s\n", std::to_string(package.number).c_str(),
-								std::to_string(connection.number_receive).c_str());
-						}
-						else if (package.number < connection.number_receive)
-						{
-							printf("Package #%s already received, resending acknowledge\n", std::to_string(package.number).c_str());
-							ack = true;
-						}
-						else
-						{
-							ack = true;
-							push = true;
-						}
-
-						if (ack)
-						{
-							Package package_ack;
-							package_ack.number = connection.number_receive;
-							bcopy(Acknowledge_prefix, package_ack.message.message, strlen(Acknowledge_prefix));
-							package_ack.message.length = strlen(package_ack.message.message);
-							send_immediate(address, package_ack);
-						}
-
-						if (push)
-						{
-							Input_message message;
-							message.address = address;
-							message.message = package.message;
-							shared.message_queue.push_back(message);
-
-							++connection.number_receive;
-						}
-					}
+// sessions in flight on one connection, each in slot number % capacity
+class Send_ring
+{
+public:
+	// the capacity covers the largest window, allocated on the first push
+	void reserve(int32 window)
+	{
+		capacity = round_up_power_of_two(window);
+	}
 
-				}
-			}
+	// session.number should be next()
+	void push(const Send_session& session)
+	{
+		if (slots.empty()) slots.resize(capacity);
+		assert(session.number == last && span() < capacity);
 
-		}
+		slots[session.number & (capacity - 1)] = session;
+		++last;
+		++count;
 	}
 
-	Connection& obtain_connection(Address address)
+	Send_session* find(Package_number number)
 	{
-		Connection* found_connection = nullptr;
-
-		for (auto& connection : shared.connections)
-		{
-			if (connection.address != address) continue;
+		int32 distance = sequence_distance(first, number);
+		if (distance < 0 || distance >= span()) return nullptr;
 
-			found_connection = &connection;
-			break;
-		}
-		if (!found_connection)
-		{
-			Connection connection;
-			connection.address = address;
-			shared.connections.push_back(connection);
-			found_connection = &shared.connections.back();
-		}
+		Send_session& session = slots[number & (capacity - 1)];
+		return session.buffer >= 0 ? &session : nullptr;
+	}
 
-		return *found_connection;
+	// the number should be in flight, find() says whether it is
+	void remove(Package_number number)
+	{
+		slots[number & (capacity - 1)].buffer = -1;
+		--count;
+		while (first != last && slots[first & (capacity - 1)].buffer < 0) ++first;
 	}
 
-	// optional address filter
-	void send(Address address, std::string in_message)
+	template <typename Function>
+	void for_each(Function function)
 	{
+		for (Package_number number = first; number != last; ++number)
 		{
-			std::lock_guard<std::mutex> _(shared.mutex);
-
-
-			if (in_message.size() == 0) return;
+			Send_session& session = slots[number & (capacity - 1)];
+			if (session.buffer >= 0) function(session);
+		}
+	}
 
-			Connection& connection = obtain_connection(address);
+	Package_number oldest() const { return first; }
+	Package_number next() const { return last; }
+	// numbers from the oldest in flight to the next to send, what the send window limits
+	int32 span() const { return sequence_distance(first, last); }
+	int32 size() const { return count; }
 
-			Package package;
-			package.number = connection.number_send;
-			bcopy(in_message.data(), package.message.message, in_message.size());
-			package.message.length = in_message.size();
+private:
+	std::vector<Send_session> slots;
+	int32 capacity{ 1 };
+	Package_number first{ 0 };
+	Package_number last{ 0 };
+	int32 count{ 0 };
+};
 
-			if (debug_disable_next_immediate_send)
-			{
-				debug_disable_next_immediate_send = false;
-			}
-			else
-			{
-				send_immediate(address, package);
-			}
-			connection.send_sessions.push_back({ package, time_ms() });
+// smoothed round trip and retransmission timeout as in RFC 6298
+struct Rtt_estimator
+{
+	Time srtt_us{ 0 };
+	Time rttvar_us{ 0 };
+	Time rto_ms{ Acknowledge_timeout_ms };
+	bool measured{ false };
 
-			++connection.number_send;
+	void sample(Time rtt_us, Time min_ms, Time max_ms)
+	{
+		if (!measured)
+		{
+			srtt_us = rtt_us;
+			rttvar_us = rtt_us / 2;
+			measured = true;
+		}
+		else
+		{
+			Time error = srtt_us > rtt_us ? srtt_us - rtt_us : rtt_us - srtt_us;
+			rttvar_us = (3 * rttvar_us + error) / 4;
+			srtt_us = (7 * srtt_us + rtt_us) / 8;
 		}
 
+		// one millisecond is the timer wheel granularity
+		Time rto_us = srtt_us + std::max<Time>(1000, 4 * rttvar_us);
+		rto_ms = std::min(std::max((rto_us + 999) / 1000, min_ms), max_ms);
 	}
 
-	bool has_message()
+	void backoff(Time max_ms)
 	{
-		{
-			std::lock_guard<std::mutex> _(shared.mutex);
-
-			return shared.message_queue.size() > 0;
-		}
+		rto_ms = std::min(rto_ms * 2, max_ms);
 	}
+};
 
-	Input_message next_message()
+// packages received ahead of the next expected one, held until the gap fills
+struct Reorder_window
+{
+	// bit i stands for package number_receive + i, bit 0 is only set while the message queue is full
+	uint64 held{ 0 };
+	// held bits whose unordered package already went to the message queue, only the number is kept
+	uint64 delivered{ 0 };
+	// serialized packages in the shard's packet pool, only while held and not delivered
+	struct Slot
 	{
-		{
-			std::lock_guard<std::mutex> _(shared.mutex);
-
-			assert(shared.message_queue.size() > 0);
+		Packet_pool::Handle buffer{ -1 };
+		int32 size{ 0 };
+	};
+	// indexed by package number modulo a power of two, allocated on the first early package
+	std::vector<Slot> slots;
+	// waiting for room in the message queue, see Server::resume_delivery
+	bool stalled{ false };
 
-			auto message = shared.message_queue.front();
-			shared.message_queue.erase(shared.message_queue.begin());
-			return message;
-		}
+	int32 occupancy() const
+	{
+		return __builtin_popcountll(held);
 	}
 
-	Time time_ms()
+	bool holds(int32 offset) const
 	{
-		return std::chrono::duration_cast<std::chrono::milliseconds>(
-			std::chrono::system_clock::now().time_since_epoch()).count();
+		return (held >> offset) & 1;
 	}
 
-	void wait_ms(Time length_ms)
+	Slot& slot(Package_number number)
 	{
-		std::this_thread::sleep_for(std::chrono::milliseconds(length_ms));
+		return slots[number & (slots.size() - 1)];
 	}
 
-	bool debug_drop_next_input_package = false; // failure to receive (did not reach the server
-	bool debug_disable_next_immediate_send = false; // allows test wrong order & resend
-
-private:
+	// points into the pool, valid until the package is released
+	Package_view view(Packet_pool& packets, Package_number number)
+	{
+		Slot& held_slot = slot(number);
+		Package_view package;
+		package.parse(packets.data(held_slot.buffer), held_slot.size);
+		return package;
+	}
 
+	void store(Packet_pool& packets, const Package_view& package, int32 offset, int32 window)
+	{
+		if (slots.empty()) slots.resize(round_up_power_of_two(window));
+		Slot& held_slot = slot(package.number);
+		held_slot.size = package.size();
+		held_slot.buffer = packets.allocate(held_slot.size);
+		package.serialize(packets.data(held_slot.buffer));
+		held |= uint64{ 1 } << offset;
+	}
 
-	bool send_immediate(Address address, Package package)
+	// frees the stored package, if any, the number stays held as delivered
+	void mark_delivered(Packet_pool& packets, Package_number number, int32 offset)
 	{
-		sockaddr_in target;
-		target.sin_family = AF_INET;
-		inet_pton(AF_INET, address.hostname.c_str(), &target.sin_addr);
-		target.sin_port = htons(address.port);
+		release(packets, number);
+		held |= uint64{ 1 } << offset;
+		delivered |= uint64{ 1 } << offset;
+	}
 
-		char buffer[sizeof(Package)];
-		int32 sz;
-		package.serialize(buffer, sz);
+	// number should be the one at offset 0
+	void advance(Packet_pool& packets, Package_number number)
+	{
+		release(packets, number);
+		held >>= 1;
+		delivered >>= 1;
+	}
 
-		int32 send_result = sendto(socket_server, buffer, sz, 0, (const sockaddr*)(&target), sizeof(target));
-		if (send_result <= 0)
+	void clear(Packet_pool& packets)
+	{
+		for (Slot& held_slot : slots)
 		{
-			printf("Failed to send a package to %s\n", address.to_string().c_str());
-			return false;
+			if (held_slot.buffer >= 0) packets.release(held_slot.buffer);
+			held_slot.buffer = -1;
 		}
-		return true;
+		held = 0;
+		delivered = 0;
 	}
 
+private:
+	void release(Packet_pool& packets, Package_number number)
+	{
+		if (slots.empty()) return;
+		Slot& held_slot = slot(number);
+		if (held_slot.buffer < 0) return;
+		packets.release(held_slot.buffer);
+		held_slot.buffer = -1;
+	}
+};
 
-	Address address_server;
-	Socket socket_server{ 0 };
+enum class Congestion_algorithm
+{
+	// the configured send window, nothing reacts to loss
+	None,
+	// slow start, then one package per round trip, collapses on a retransmission timeout
+	Aimd,
+	// grows while round trips stay near the smallest seen, backs off as queues build, after TCP Vegas
+	Delay
+};
 
-	bool is_server{ false };
+// sizes the send window of one connection from acknowledge and loss signals
+class Congestion_control
+{
+public:
+	virtual ~Congestion_control() {}
 
-	bool terminated{ false };
+	virtual const char* name() const = 0;
+	// packages allowed in flight
+	virtual int32 window() const = 0;
+	// rtt_us is 0 when none of the acknowledged packages gave a sample
+	virtual void on_acknowledge(int32 acknowledged, Time rtt_us) = 0;
+	// the oldest package in flight timed out
+	virtual void on_loss() = 0;
+};
 
-	struct Shared
-	{
-		std::vector<Connection> connections;
-		std::vector<Input_message> message_queue;
-		std::mutex mutex;
+class Fixed_window : public Congestion_control
+{
+public:
+	explicit Fixed_window(int32 limit) : limit(limit) {}
+
+	const char* name() const override { return "none"; }
+	int32 window() const override { return limit; }
+	void on_acknowledge(int32, Time) override {}
+	void on_loss() override {}
+
+private:
+	int32 limit;
+};
+
+class Aimd_control : public Congestion_control
+{
+public:
+	explicit Aimd_control(int32 limit) : limit(limit), threshold(limit) {}
+
+	const char* name() const override { return "aimd"; }
+
+	int32 window() const override
+	{
+		return std::max(1, std::min(limit, int32(congestion_window)));
+	}
+
+	void on_acknowledge(int32 acknowledged, Time) override
+	{
+		if (congestion_window < threshold) congestion_window += acknowledged;
+		else congestion_window += double(acknowledged) / congestion_window;
+		congestion_window = std::min(congestion_window, double(limit));
+	}
+
+	void on_loss() override
+	{
+		threshold = std::max(congestion_window / 2, 2.0);
+		congestion_window = 1;
+	}
+
+private:
+	int32 limit;
+	double congestion_window{ 2 };
+	double threshold;
+};
+
+class Delay_control : public Congestion_control
+{
+public:
+	// packages allowed to sit in queues along the path
+	static constexpr double Queued_low = 2;
+	static constexpr double Queued_high = 4;
+
+	explicit Delay_control(int32 limit) : limit(limit) {}
+
+	const char* name() const override { return "delay"; }
+
+	int32 window() const override
+	{
+		return std::max(1, std::min(limit, int32(congestion_window)));
+	}
+
+	void on_acknowledge(int32 acknowledged, Time rtt_us) override
+	{
+		if (rtt_us == 0) return;
+		if (base_rtt_us == 0 || rtt_us < base_rtt_us) base_rtt_us = rtt_us;
+
+		// window minus the bandwidth delay product at the base round trip
+		double queued = congestion_window * (1.0 - double(base_rtt_us) / rtt_us);
+		if (slow_start)
+		{
+			if (queued > Queued_high) slow_start = false;
+			else congestion_window += acknowledged;
+		}
+		else if (queued < Queued_low)
+		{
+			congestion_window += double(acknowledged) / congestion_window;
+		}
+		else if (queued > Queued_high)
+		{
+			congestion_window -= double(acknowledged) / congestion_window;
+		}
+		congestion_window = std::min(std::max(congestion_window, 1.0), double(limit));
+	}
+
+	void on_loss() override
+	{
+		slow_start = false;
+		congestion_window = std::max(congestion_window / 2, 1.0);
+	}
+
+private:
+	int32 limit;
+	double congestion_window{ 2 };
+	Time base_rtt_us{ 0 };
+	bool slow_start{ true };
+};
+
+std::unique_ptr<Congestion_control> make_congestion(Congestion_algorithm algorithm, int32 limit)
+{
+	switch (algorithm)
+	{
+	case Congestion_algorithm::Aimd: return std::unique_ptr<Congestion_control>(new Aimd_control(limit));
+	case Congestion_algorithm::Delay: return std::unique_ptr<Congestion_control>(new Delay_control(limit));
+	default: return std::unique_ptr<Congestion_control>(new Fixed_window(limit));
+	}
+}
+
+// fragments of the message being received
+struct Reassembly
+{
+	std::string data;
+	Time last_ms{ 0 };
+	int32 timer{ -1 };
+	// the message outgrew message_limit or timed out, its remaining fragments are skipped
+	bool discarding{ false };
+};
+
+enum class Handshake
+{
+	// waiting for the peer's cookie, sends stay queued
+	Hello,
+	// the cookie goes in front of every datagram until the peer answers
+	Echo,
+	// the peer holds a connection for this address
+	Done
+};
+
+// ordering and reassembly of one stream
+struct Stream_state
+{
+	// sequence of the next ordered package sent on the stream, and of the next one delivered
+	uint16 next_send{ 0 };
+	uint16 next_receive{ 0 };
+	Reassembly reassembly;
+};
+
+struct Connection
+{
+	bool banned{ false };
+	Address address;
+	Connection_handle handle{ -1 };
+	Handshake handshake{ Handshake::Done };
+	Cookie_payload cookie;
+	uint32 incarnation{ 0 };
+	int32 handshake_timer{ -1 };
+	// when the first Hello went out, 0 once it was repeated
+	Time hello_sent_us{ 0 };
+	// when the peer was last heard from, and when the next keepalive probe is due while it stays quiet
+	Time last_active_ms{ 0 };
+	Time probe_due_ms{ 0 };
+	Package_number number_send{ 0 };
+	Package_number number_receive{ 0 };
+	// unreliable sequenced packages have their own numbers, the next to send and the next accepted
+	Package_number sequenced_send{ 0 };
+	Package_number sequenced_receive{ 0 };
+	bool acknowledge_pending{ false };
+	// in order packages not acknowledged yet, the acknowledge goes out at the deadline or rides on data
+	int32 acknowledge_owed{ 0 };
+	Time acknowledge_due_us{ 0 };
+
+	Rtt_estimator rtt;
+	std::unique_ptr<Congestion_control> congestion;
+	Reorder_window reorder;
+	// stream 0 inline, the others allocated once the peer uses them
+	Stream_state first_stream;
+	std::vector<Stream_state> more_streams;
+	// a stream past 0 was sent on, every ordered package carries its stream from then on
+	bool streamed{ false };
+
+	// serialized packages waiting to share a datagram
+	std::vector<char> coalesced;
+	Time coalesce_started_us{ 0 };
+	bool coalesce_listed{ false };
+
+	Send_ring send_sessions;
+	// packages waiting for room in the send window, numbered when they go out
+	std::deque<Send_session> send_queue;
+	// a send was refused, Server::send_ready reports the connection once the queue drains
+	bool send_blocked{ false };
+
+	Stream_state& stream(int32 index)
+	{
+		if (index == 0) return first_stream;
+		if (more_streams.size() < index) more_streams.resize(index);
+		return more_streams[index - 1];
+	}
+};
+
+// hierarchical timing wheel with millisecond ticks, arm and cancel are O(1)
+class Timer_wheel
+{
+public:
+	static constexpr int32 Slot_bits = 6;
+	static constexpr int32 Slots = 1 << Slot_bits;
+	static constexpr int32 Levels = 4;
+	static constexpr Time Horizon = Time{ 1 } << (Slot_bits * Levels);
+
+	Timer_wheel()
+	{
+		for (auto& head : heads) head = -1;
+	}
+
+	void start(Time now) { current = now; }
+
+	// the tag comes back to the callback untouched when the timer fires
+	int32 arm(Time now, Time expires, uint64 tag)
+	{
+		// an empty wheel is not advanced while idle, catching up tick by tick would stall the first advance after a long gap
+		if (count == 0) current = std::max(current, now);
+
+		int32 timer;
+		if (free_nodes.empty())
+		{
+			timer = nodes.size();
+			nodes.emplace_back();
+		}
+		else
+		{
+			timer = free_nodes.back();
+			free_nodes.pop_back();
+		}
+
+		nodes[timer].expires = std::max(expires, current + 1);
+		nodes[timer].tag = tag;
+		link(timer);
+		++count;
+		return timer;
+	}
+
+	void cancel(int32 timer)
+	{
+		unlink(timer);
+		nodes[timer].bucket = -1;
+		free_nodes.push_back(timer);
+		--count;
+	}
+
+	// fires every timer due by now, the callback may arm new ones
+	template <typename Callback>
+	void advance(Time now, Callback fire)
+	{
+		if (count == 0)
+		{
+			current = std::max(current, now);
+			return;
+		}
+
+		while (current < now)
+		{
+			++current;
+
+			// higher levels first so their timers settle into lower slots before those are read
+			int32 level = 0;
+			while (level + 1 < Levels && (current & ((Time{ 1 } << (Slot_bits * (level + 1))) - 1)) == 0) ++level;
+			for (; level > 0; --level)
+			{
+				int32 bucket = level * Slots + ((current >> (Slot_bits * level)) & (Slots - 1));
+				int32 timer = heads[bucket];
+				heads[bucket] = -1;
+				while (timer >= 0)
+				{
+					int32 next = nodes[timer].next;
+					link(timer);
+					timer = next;
+				}
+			}
+
+			int32 bucket = current & (Slots - 1);
+			while (heads[bucket] >= 0)
+			{
+				int32 timer = heads[bucket];
+				uint64 tag = nodes[timer].tag;
+				cancel(timer);
+				fire(tag);
+			}
+
+			if (count == 0)
+			{
+				current = now;
+				break;
+			}
+		}
+	}
+
+	// exact for timers in the nearest level, the next cascade tick for the rest, 0 when nothing is armed
+	Time next_expiry() const
+	{
+		if (count == 0) return 0;
+
+		Time result = ~Time{ 0 };
+		for (int32 level = 0; level < Levels; ++level)
+		{
+			int32 shift = Slot_bits * level;
+			for (int32 i = 1; i <= Slots; ++i)
+			{
+				Time block = (current >> shift) + i;
+				if (heads[level * Slots + (block & (Slots - 1))] < 0) continue;
+				result = std::min(result, block << shift);
+				break;
+			}
+		}
+		return result;
+	}
+
+	int32 size() const { return count; }
+
+private:
+	struct Node
+	{
+		Time expires{ 0 };
+		uint64 tag{ 0 };
+		int32 bucket{ -1 };
+		int32 previous{ -1 };
+		int32 next{ -1 };
+	};
+
+	void link(int32 timer)
+	{
+		Node& node = nodes[timer];
+		Time delta = std::min(node.expires - current, Horizon - 1);
+		Time expires = current + delta;
+
+		int32 level = 0;
+		while (level + 1 < Levels && delta >= (Time{ 1 } << (Slot_bits * (level + 1)))) ++level;
+		int32 bucket = level * Slots + ((expires >> (Slot_bits * level)) & (Slots - 1));
+
+		node.bucket = bucket;
+		node.previous = -1;
+		node.next = heads[bucket];
+		if (node.next >= 0) nodes[node.next].previous = timer;
+		heads[bucket] = timer;
+	}
+
+	void unlink(int32 timer)
+	{
+		Node& node = nodes[timer];
+		if (node.previous >= 0) nodes[node.previous].next = node.next;
+		else heads[node.bucket] = node.next;
+		if (node.next >= 0) nodes[node.next].previous = node.previous;
+	}
+
+	int32 heads[Slots * Levels];
+	std::vector<Node> nodes;
+	std::vector<int32> free_nodes;
+	Time current{ 0 };
+	int32 count{ 0 };
+};
+
+// open addressing index over stable connection storage, keyed by binary ip and port
+class Connection_table
+{
+public:
+	static uint64 key(const sockaddr_in& addr)
+	{
+		return (uint64(addr.sin_addr.s_addr) << 16) | addr.sin_port;
+	}
+
+	Connection_handle find(uint64 key) const
+	{
+		if (slots.empty()) return -1;
+
+		for (uint64 i = hash(key) & mask(); ; i = (i + 1) & mask())
+		{
+			const Slot& slot = slots[i];
+			if (slot.handle < 0) return -1;
+			if (slot.key == key) return slot.handle;
+		}
+	}
+
+	// reuses the handle of an erased connection first, the new one is the most recently active
+	Connection_handle insert(uint64 key, Connection&& connection)
+	{
+		// kept at most half full so probe chains stay short
+		if ((count + 1) * 2 > slots.size()) grow();
+
+		Connection_handle handle;
+		if (!free_handles.empty())
+		{
+			handle = free_handles.back();
+			free_handles.pop_back();
+			storage[handle] = std::move(connection);
+		}
+		else
+		{
+			handle = storage.size();
+			storage.push_back(std::move(connection));
+			recency.emplace_back();
+		}
+		place(key, handle);
+		link_newest(handle);
+		++count;
+		return handle;
+	}
+
+	// backward shift deletion, the probe chains stay unbroken without tombstones
+	void erase(uint64 key)
+	{
+		uint64 i = hash(key) & mask();
+		while (slots[i].key != key)
+		{
+			if (slots[i].handle < 0) return;
+			i = (i + 1) & mask();
+		}
+		Connection_handle handle = slots[i].handle;
+
+		for (uint64 j = (i + 1) & mask(); slots[j].handle >= 0; j = (j + 1) & mask())
+		{
+			// an entry moves into the hole unless its home lies between the hole and where it sits
+			uint64 home = hash(slots[j].key) & mask();
+			if (((j - home) & mask()) >= ((j - i) & mask()))
+			{
+				slots[i] = slots[j];
+				i = j;
+			}
+		}
+		slots[i] = Slot{};
+
+		unlink(handle);
+		storage[handle] = Connection{};
+		free_handles.push_back(handle);
+		--count;
+	}
+
+	// references stay valid until the connection is erased
+	Connection& get(Connection_handle handle) { return storage[handle]; }
+
+	bool contains(Connection_handle handle) const { return handle >= 0 && handle < storage.size() && storage[handle].handle >= 0; }
+
+	int32 size() const { return count; }
+
+	// moves the connection to the most recently active end
+	void touch(Connection_handle handle)
+	{
+		if (newest == handle) return;
+		unlink(handle);
+		link_newest(handle);
+	}
+
+	// walks from the least recently active connection, -1 past the end
+	Connection_handle oldest() const { return oldest_handle; }
+	Connection_handle newer(Connection_handle handle) const { return recency[handle].newer; }
+
+	std::deque<Connection>::iterator begin() { return storage.begin(); }
+	std::deque<Connection>::iterator end() { return storage.end(); }
+
+private:
+	struct Slot
+	{
+		uint64 key{ 0 };
+		Connection_handle handle{ -1 };
+	};
+
+	struct Recency
+	{
+		Connection_handle newer{ -1 };
+		Connection_handle older{ -1 };
+	};
+
+	void link_newest(Connection_handle handle)
+	{
+		recency[handle] = Recency{ -1, newest };
+		if (newest >= 0) recency[newest].newer = handle;
+		newest = handle;
+		if (oldest_handle < 0) oldest_handle = handle;
+	}
+
+	void unlink(Connection_handle handle)
+	{
+		Recency& links = recency[handle];
+		if (links.newer >= 0) recency[links.newer].older = links.older;
+		else newest = links.older;
+		if (links.older >= 0) recency[links.older].newer = links.newer;
+		else oldest_handle = links.newer;
+		links = Recency{};
+	}
+
+	static uint64 hash(uint64 key)
+	{
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdull;
+		key ^= key >> 33;
+		key *= 0xc4ceb9fe1a85ec53ull;
+		key ^= key >> 33;
+		return key;
+	}
+
+	uint64 mask() const { return slots.size() - 1; }
+
+	void place(uint64 key, Connection_handle handle)
+	{
+		uint64 i = hash(key) & mask();
+		while (slots[i].handle >= 0) i = (i + 1) & mask();
+		slots[i].key = key;
+		slots[i].handle = handle;
+	}
+
+	void grow()
+	{
+		std::vector<Slot> old;
+		old.swap(slots);
+		slots.resize(std::max<size_t>(16, old.size() * 2));
+		for (auto& slot : old)
+		{
+			if (slot.handle >= 0) place(slot.key, slot.handle);
+		}
+	}
+
+	std::vector<Slot> slots;
+	std::deque<Connection> storage;
+	// erased entries are left default constructed, with handle -1, until a new connection takes them
+	std::vector<Connection_handle> free_handles;
+	// a list through the handles ordered by activity
+	std::vector<Recency> recency;
+	Connection_handle newest{ -1 };
+	Connection_handle oldest_handle{ -1 };
+	int32 count{ 0 };
+};
+
+// token buckets in a fixed table hashed by source, sources that collide share one so a flood of addresses allocates nothing
+class Rate_limiter
+{
+public:
+	// rate in datagrams per second, 0 admits everything, bucket_count a power of two
+	void configure(int32 rate, int32 burst, int32 bucket_count, const uint64 seed[2])
+	{
+		assert((bucket_count & (bucket_count - 1)) == 0);
+
+		this->rate = rate;
+		capacity = uint64(burst) * Token;
+		this->seed[0] = seed[0];
+		this->seed[1] = seed[1];
+		buckets.assign(rate > 0 ? bucket_count : 0, Bucket{ capacity, 0 });
+	}
+
+	bool enabled() const { return rate > 0; }
+
+	// takes a token for the source, false when its bucket is empty
+	bool admit(uint64 key, Time now_us)
+	{
+		if (!enabled()) return true;
+
+		// keyed, so a sender cannot pick addresses that land on someone else's bucket
+		Bucket& bucket = buckets.size() == 1 ? buckets[0] : buckets[siphash(seed, (const char*)&key, sizeof(key)) & (buckets.size() - 1)];
+		if (now_us > bucket.last_us)
+		{
+			// a long idle bucket is full, checked first so the product cannot overflow
+			Time elapsed = now_us - bucket.last_us;
+			bucket.level = elapsed >= capacity / rate ? capacity : std::min(capacity, bucket.level + elapsed * rate);
+			bucket.last_us = now_us;
+		}
+		if (bucket.level < Token) return false;
+		bucket.level -= Token;
+		return true;
+	}
+
+private:
+	// levels count millionths of a token, a microsecond refills rate of them
+	static constexpr uint64 Token = 1000000;
+
+	struct Bucket
+	{
+		uint64 level;
+		Time last_us;
+	};
+
+	std::vector<Bucket> buckets;
+	uint64 capacity{ 0 };
+	int32 rate{ 0 };
+	uint64 seed[2]{};
+};
+
+// outbound link for benchmarks: random loss, then a rate limited queue with tail drop, then a fixed delay
+class Link_emulator
+{
+public:
+	struct Datagram
+	{
+		Time release_us;
+		sockaddr_in addr;
+		int32 size;
+		char buffer[Datagram_limit];
 	};
-	Shared shared;
+
+	void configure(double loss, Time delay_ms, int32 rate, int32 queue_limit, uint64 seed)
+	{
+		this->loss = loss;
+		delay_us = delay_ms * 1000;
+		interval_us = rate > 0 ? 1000000 / rate : 0;
+		this->queue_limit = queue_limit;
+		random = seed | 1;
+	}
+
+	bool enabled() const
+	{
+		return loss > 0 || delay_us > 0 || interval_us > 0;
+	}
+
+	// false when the datagram was dropped
+	bool push(Time now_us, const sockaddr_in& addr, const char* buffer, int32 size)
+	{
+		// xorshift, the emulator only needs a cheap uniform draw
+		random ^= random << 13;
+		random ^= random >> 7;
+		random ^= random << 17;
+		if ((random >> 11) * (1.0 / (uint64{ 1 } << 53)) < loss)
+		{
+			++random_drops;
+			return false;
+		}
+
+		Time start_us = std::max(now_us, link_free_us);
+		if (interval_us > 0 && (start_us - now_us) / interval_us >= queue_limit)
+		{
+			++queue_drops;
+			return false;
+		}
+		link_free_us = start_us + interval_us;
+
+		Datagram datagram;
+		datagram.release_us = link_free_us + delay_us;
+		datagram.addr = addr;
+		datagram.size = size;
+		bcopy(buffer, datagram.buffer, size);
+		queue.push_back(datagram);
+		return true;
+	}
+
+	// every datagram is delayed by the same amount, so release order is arrival order
+	template<typename Send>
+	void release(Time now_us, Send send)
+	{
+		while (!queue.empty() && queue.front().release_us <= now_us)
+		{
+			send(queue.front());
+			queue.pop_front();
+		}
+	}
+
+	// 0 when nothing is waiting
+	Time next_release_us() const
+	{
+		return queue.empty() ? 0 : queue.front().release_us;
+	}
+
+	uint64 random_drops{ 0 };
+	uint64 queue_drops{ 0 };
+
+private:
+	double loss{ 0 };
+	Time delay_us{ 0 };
+	Time interval_us{ 0 };
+	int32 queue_limit{ 0 };
+	Time link_free_us{ 0 };
+	uint64 random{ 1 };
+	std::deque<Datagram> queue;
+};
+
+struct Server_config
+{
+	// datagrams pulled per recvmmsg call, 1 keeps the plain recvfrom loop
+	int32 receive_batch_size{ 16 };
+	// single epoll thread instead of the listen/resend/logic threads
+	bool event_loop{ false };
+	// io_uring transport, falls back to sockets when the kernel refuses it
+	bool uring{ false };
+	// SO_REUSEPORT sockets, each with its own worker and connection table
+	int32 shards{ 1 };
+	// per package log lines, the only text formatting on the packet path
+	bool trace{ true };
+	// inbound message slots per shard, a power of two
+	int32 message_queue_capacity{ 1024 };
+	// bounds for the adaptive retransmission timeout
+	Time rto_min_ms{ 20 };
+	Time rto_max_ms{ 60000 };
+	// out of order packages held per connection, 1 delivers strictly in order
+	int32 reorder_window{ Acknowledge_mask_bits };
+	// unacknowledged packages in flight per connection
+	int32 send_window{ Acknowledge_mask_bits };
+	// packages queued behind a full send window before send would block, an empty queue takes any one message
+	int32 send_queue_limit{ 256 };
+	// longest message send takes and the receiver reassembles
+	int32 message_limit{ 64 * 1024 };
+	// a partly received message is dropped when no fragment arrives for this long
+	Time reassembly_timeout_ms{ 10000 };
+	// packages to one peer share a datagram for up to this long, 0 sends each at once
+	Time coalesce_us{ 0 };
+	// in order packages are acknowledged this much later unless data to the peer carries it, 0 acknowledges each batch
+	Time acknowledge_delay_us{ 1000 };
+	// sizes each connection's window below send_window
+	Congestion_algorithm congestion{ Congestion_algorithm::Aimd };
+	// outbound link emulator, off while loss, delay and rate are all zero
+	double emulate_loss{ 0 };
+	Time emulate_delay_ms{ 0 };
+	// datagrams per second, 0 is unlimited
+	int32 emulate_rate{ 0 };
+	// datagrams waiting on the rate limit before the link drops
+	int32 emulate_queue{ 64 };
+	// a quiet peer is probed after this long and again at the same interval, 0 never probes
+	Time keepalive_ms{ 5000 };
+	// a peer silent for this long is taken for dead and its connection evicted, 0 keeps it
+	// the same sweep returns free packet pool slabs, with both intervals 0 the pool stays at its high water mark
+	Time idle_timeout_ms{ 30000 };
+	// connections over all shards, the least recently active one is evicted to admit another
+	int32 connection_limit{ 16384 };
+	// datagrams per second taken from one source address and over all of them, 0 is unlimited, checked before parsing
+	int32 source_rate{ 0 };
+	int32 source_burst{ 64 };
+	int32 global_rate{ 0 };
+	int32 global_burst{ 1024 };
+};
+
+bool parse_arguments(int argc, char* argv[], Server_config& out)
+{
+	for (int32 i = 1; i < argc; ++i)
+	{
+		std::string argument = argv[i];
+		bool has_value = i + 1 < argc;
+
+		if (argument == "--batch" && has_value)
+		{
+			out.receive_batch_size = std::stoi(argv[++i]);
+		}
+		else if (argument == "--event-loop")
+		{
+			out.event_loop = true;
+		}
+		else if (argument == "--uring")
+		{
+			out.uring = true;
+		}
+		else if (argument == "--shards" && has_value)
+		{
+			out.shards = std::stoi(argv[++i]);
+		}
+		else if (argument == "--quiet")
+		{
+			out.trace = false;
+		}
+		else if (argument == "--queue" && has_value)
+		{
+			out.message_queue_capacity = std::stoi(argv[++i]);
+		}
+		else if (argument == "--rto-min" && has_value)
+		{
+			out.rto_min_ms = std::stoull(argv[++i]);
+		}
+		else if (argument == "--rto-max" && has_value)
+		{
+			out.rto_max_ms = std::stoull(argv[++i]);
+		}
+		else if (argument == "--reorder" && has_value)
+		{
+			out.reorder_window = std::stoi(argv[++i]);
+		}
+		else if (argument == "--send-window" && has_value)
+		{
+			out.send_window = std::stoi(argv[++i]);
+		}
+		else if (argument == "--send-queue" && has_value)
+		{
+			out.send_queue_limit = std::stoi(argv[++i]);
+		}
+		else if (argument == "--message-limit" && has_value)
+		{
+			out.message_limit = std::stoi(argv[++i]);
+		}
+		else if (argument == "--reassembly-timeout" && has_value)
+		{
+			out.reassembly_timeout_ms = std::stoull(argv[++i]);
+		}
+		else if (argument == "--ack-delay" && has_value)
+		{
+			out.acknowledge_delay_us = std::stoull(argv[++i]);
+		}
+		else if (argument == "--coalesce" && has_value)
+		{
+			out.coalesce_us = std::stoull(argv[++i]);
+		}
+		else if (argument == "--congestion" && has_value)
+		{
+			std::string algorithm = argv[++i];
+			if (algorithm == "none") out.congestion = Congestion_algorithm::None;
+			else if (algorithm == "aimd") out.congestion = Congestion_algorithm::Aimd;
+			else if (algorithm == "delay") out.congestion = Congestion_algorithm::Delay;
+			else
+			{
+				printf("Congestion control should be none, aimd or delay\n");
+				return false;
+			}
+		}
+		else if (argument == "--loss" && has_value)
+		{
+			out.emulate_loss = std::stod(argv[++i]) / 100;
+		}
+		else if (argument == "--delay" && has_value)
+		{
+			out.emulate_delay_ms = std::stoull(argv[++i]);
+		}
+		else if (argument == "--rate" && has_value)
+		{
+			out.emulate_rate = std::stoi(argv[++i]);
+		}
+		else if (argument == "--link-queue" && has_value)
+		{
+			out.emulate_queue = std::stoi(argv[++i]);
+		}
+		else if (argument == "--keepalive" && has_value)
+		{
+			out.keepalive_ms = std::stoull(argv[++i]);
+		}
+		else if (argument == "--idle-timeout" && has_value)
+		{
+			out.idle_timeout_ms = std::stoull(argv[++i]);
+		}
+		else if (argument == "--connections" && has_value)
+		{
+			out.connection_limit = std::stoi(argv[++i]);
+		}
+		else if (argument == "--source-rate" && has_value)
+		{
+			out.source_rate = std::stoi(argv[++i]);
+		}
+		else if (argument == "--source-burst" && has_value)
+		{
+			out.source_burst = std::stoi(argv[++i]);
+		}
+		else if (argument == "--global-rate" && has_value)
+		{
+			out.global_rate = std::stoi(argv[++i]);
+		}
+		else if (argument == "--global-burst" && has_value)
+		{
+			out.global_burst = std::stoi(argv[++i]);
+		}
+		else
+		{
+			printf("Unknown argument %s\n", argument.c_str());
+			return false;
+		}
+	}
+
+	if (out.receive_batch_size < 1 || out.receive_batch_size > Receive_batch_limit)
+	{
+		printf("Batch size should be in [1, %d]\n", Receive_batch_limit);
+		return false;
+	}
+
+	if (out.shards < 1 || out.shards > Shard_limit)
+	{
+		printf("Shard count should be in [1, %d]\n", Shard_limit);
+		return false;
+	}
+
+	int32 capacity = out.message_queue_capacity;
+	if (capacity < 2 || (capacity & (capacity - 1)) != 0)
+	{
+		printf("Queue capacity should be a power of two\n");
+		return false;
+	}
+
+	if (out.rto_min_ms < 1 || out.rto_max_ms < out.rto_min_ms)
+	{
+		printf("Retransmission timeout bounds should satisfy 1 <= min <= max\n");
+		return false;
+	}
+
+	if (out.reorder_window < 1 || out.reorder_window > Acknowledge_mask_bits)
+	{
+		printf("Reorder window should be in [1, %d]\n", Acknowledge_mask_bits);
+		return false;
+	}
+
+	if (out.send_window < 1 || out.send_window > Send_window_limit || out.send_queue_limit < 0)
+	{
+		printf("Send window should be from 1 to %d and the send queue not negative\n", Send_window_limit);
+		return false;
+	}
+
+	if (out.message_limit < 1 || out.reassembly_timeout_ms < 1)
+	{
+		printf("Message limit and reassembly timeout should be positive\n");
+		return false;
+	}
+
+	if (out.emulate_loss < 0 || out.emulate_loss > 1 || out.emulate_rate < 0 || out.emulate_queue < 1)
+	{
+		printf("Emulated loss should be in [0, 100] percent, rate not negative and link queue positive\n");
+		return false;
+	}
+
+	if (out.connection_limit < out.shards)
+	{
+		printf("Connection limit should be at least the shard count\n");
+		return false;
+	}
+
+	if (out.source_rate < 0 || out.global_rate < 0 || out.source_burst < 1 || out.global_burst < 1)
+	{
+		printf("Rate limits should not be negative and bursts should be positive\n");
+		return false;
+	}
+
+	return true;
+}
+
+// minimal io_uring over the raw syscalls, liburing is not required on the target
+class Uring
+{
+public:
+	Uring() {}
+	Uring(const Uring&) = delete;
+	~Uring() { release(); }
+
+	bool open(uint32 entries)
+	{
+		io_uring_params params = { 0 };
+		fd = syscall(__NR_io_uring_setup, entries, &params);
+		if (fd < 0) return false;
+
+		sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32);
+		cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+		if (single_mmap) sq_size = cq_size = std::max(sq_size, cq_size);
+
+		sq_ring = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+		if (sq_ring == MAP_FAILED)
+		{
+			sq_ring = nullptr;
+			release();
+			return false;
+		}
+		cq_ring = single_mmap ? sq_ring :
+			mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq_ring == MAP_FAILED)
+		{
+			cq_ring = nullptr;
+			release();
+			return false;
+		}
+		sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+		sqes = (io_uring_sqe*)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED)
+		{
+			sqes = nullptr;
+			release();
+			return false;
+		}
+
+		char* sq = (char*)sq_ring;
+		sq_head = (uint32*)(sq + params.sq_off.head);
+		sq_tail = (uint32*)(sq + params.sq_off.tail);
+		sq_mask = *(uint32*)(sq + params.sq_off.ring_mask);
+		sq_array = (uint32*)(sq + params.sq_off.array);
+		sq_entries = params.sq_entries;
+
+		char* cq = (char*)cq_ring;
+		cq_head = (uint32*)(cq + params.cq_off.head);
+		cq_tail = (uint32*)(cq + params.cq_off.tail);
+		cq_mask = *(uint32*)(cq + params.cq_off.ring_mask);
+		cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+		return true;
+	}
+
+	bool opened() const { return fd >= 0; }
+	int32 descriptor() const { return fd; }
+
+	// zeroed entry at the tail, nullptr when the submission queue is full
+	io_uring_sqe* next_sqe()
+	{
+		uint32 tail = *sq_tail;
+		if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) return nullptr;
+
+		uint32 index = tail & sq_mask;
+		io_uring_sqe* sqe = &sqes[index];
+		*sqe = io_uring_sqe{};
+		sq_array[index] = index;
+		__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+		++pending;
+		return sqe;
+	}
+
+	// hands queued entries to the kernel without waiting
+	int32 submit()
+	{
+		uint32 count = take_pending();
+		if (count == 0) return 0;
+		return enter(count, 0);
+	}
+
+	uint32 take_pending()
+	{
+		uint32 count = pending;
+		pending = 0;
+		return count;
+	}
+
+	int32 enter(uint32 count, uint32 wait_for)
+	{
+		uint32 flags = wait_for > 0 ? IORING_ENTER_GETEVENTS : 0;
+		return syscall(__NR_io_uring_enter, fd, count, wait_for, flags, nullptr, 0);
+	}
+
+	io_uring_cqe* peek()
+	{
+		uint32 head = *cq_head;
+		if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) return nullptr;
+		return &cqes[head & cq_mask];
+	}
+
+	void advance()
+	{
+		__atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+	}
+
+private:
+	void release()
+	{
+		if (sqes) munmap(sqes, sqes_size);
+		if (cq_ring && cq_ring != sq_ring) munmap(cq_ring, cq_size);
+		if (sq_ring) munmap(sq_ring, sq_size);
+		if (fd >= 0) close(fd);
+		sqes = nullptr;
+		sq_ring = cq_ring = nullptr;
+		fd = -1;
+	}
+
+	int32 fd{ -1 };
+	uint32 pending{ 0 };
+
+	void* sq_ring{ nullptr };
+	void* cq_ring{ nullptr };
+	size_t sq_size{ 0 };
+	size_t cq_size{ 0 };
+	io_uring_sqe* sqes{ nullptr };
+	size_t sqes_size{ 0 };
+
+	uint32* sq_head{ nullptr };
+	uint32* sq_tail{ nullptr };
+	uint32* sq_array{ nullptr };
+	uint32 sq_mask{ 0 };
+	uint32 sq_entries{ 0 };
+
+	uint32* cq_head{ nullptr };
+	uint32* cq_tail{ nullptr };
+	uint32 cq_mask{ 0 };
+	io_uring_cqe* cqes{ nullptr };
+};
+
+class Server
+{
+public:
+	Server() {}
+	Server(const Server&) = delete;
+	~Server()
+	{
+		if (wake_fd >= 0) close(wake_fd);
+	}
+
+	bool start(bool is_server, const Server_config& config = Server_config{})
+	{
+		assert(state == State::None);
+
+		this->is_server = is_server;
+		this->config = config;
+
+		if (getrandom(cookie_key, sizeof(cookie_key), 0) != sizeof(cookie_key))
+		{
+			printf("Failed to generate cookie key");
+			return false;
+		}
+
+		address_server = Address{ "127.0.0.1", Network_port };
+
+		// a client has one ephemeral port, sharding only makes sense for a bound server
+		int32 shard_count = is_server ? config.shards : 1;
+		for (int32 i = 0; i < shard_count; ++i)
+		{
+			shards.emplace_back(new Shard());
+			shards.back()->index = i;
+			if (!open_shard(*shards.back(), shard_count > 1))
+			{
+				close_shards();
+				return false;
+			}
+		}
+
+		wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (wake_fd < 0)
+		{
+			printf("Failed to create wake event");
+			close_shards();
+			return false;
+		}
+
+		state = State::Started;
+
+		return true;
+	}
+
+	bool running() const { return state == State::Started; }
+
+	int32 shard_count() const { return shards.size(); }
+
+	void terminate()
+	{
+		// the master thread and the event loop may both get here, only one closes the shards
+		State started = State::Started;
+		if (state.compare_exchange_strong(started, State::Terminated))
+		{
+			terminated = true;
+			wake();
+			notify_message(true);
+			close_shards();
+			printf("Server terminated\n");
+		}
+	}
+
+	// slots interleave shards so they stay stable as connections are added
+	std::string get_clients()
+	{
+		std::string result;
+		for (auto& shard : shards)
+		{
+			std::lock_guard<std::mutex> _(shard->mutex);
+
+			Connection_handle handle = 0;
+			for (auto& connection : shard->connections)
+			{
+				int32 slot = handle++ * shards.size() + shard->index;
+				if (connection.handle < 0) continue;
+				result += "#" + std::to_string(slot) + " at " + connection.address.to_string();
+				if (shards.size() > 1) result += " on shard " + std::to_string(shard->index);
+
+				char timing[64];
+				if (connection.rtt.measured) snprintf(timing, sizeof(timing), ", rtt %.3f ms", connection.rtt.srtt_us / 1000.0);
+				else snprintf(timing, sizeof(timing), ", rtt unknown");
+				result += timing;
+				result += ", rto " + std::to_string(connection.rtt.rto_ms) + " ms";
+				result += ", " + std::to_string(connection.send_sessions.size()) + "/" + std::to_string(send_limit(connection)) + " in flight (" + connection.congestion->name() + ")";
+				if (!connection.send_queue.empty()) result += ", " + std::to_string(connection.send_queue.size()) + " queued";
+				int32 held = connection.reorder.occupancy();
+				if (held > 0) result += ", " + std::to_string(held) + " held";
+				if (!connection.more_streams.empty()) result += ", " + std::to_string(connection.more_streams.size() + 1) + " streams";
+				if (connection.banned) result += " (banned)";
+				result += "\n";
+			}
+		}
+		return result;
+	}
+
+	bool ban_client(int32 slot)
+	{
+		{
+			if (slot < 0) return false;
+
+			Shard& shard = *shards[slot % shards.size()];
+			std::lock_guard<std::mutex> _(shard.mutex);
+
+			Connection_handle handle = slot / shards.size();
+			if (!shard.connections.contains(handle)) return false;
+			shard.connections.get(handle).banned = true;
+			return true;
+		}
+
+		return false;
+	}
+
+	// sleeps until the earliest retransmission is due
+	void resend_thread(int32 shard = 0)
+	{
+		assert(state == State::Started);
+
+		Shard& owner = *shards[shard];
+		while (!terminated)
+		{
+			pollfd fds[2] = { { owner.timer_fd, POLLIN, 0 }, { wake_fd, POLLIN, 0 } };
+			if (poll(fds, 2, -1) < 0 && errno != EINTR) break;
+			if (terminated) break;
+
+			if (fds[0].revents & POLLIN)
+			{
+				uint64 expirations;
+				read(owner.timer_fd, &expirations, sizeof(expirations));
+				resend_expired(owner);
+			}
+		}
+	}
+
+	void listen_thread(int32 shard = 0)
+	{
+		Shard& owner = *shards[shard];
+
+		if (owner.uring.opened())
+		{
+			listen_uring(owner);
+			return;
+		}
+
+		if (config.receive_batch_size > 1)
+		{
+			listen_batched(owner);
+			return;
+		}
+
+		while (!terminated)
+		{
+			char buffer[Datagram_limit];
+
+			sockaddr_in addr = { 0 };
+			uint32 addr_size = sizeof(addr);
+
+			// an empty datagram is valid input, only an error or terminate ends the loop
+			int32 n = recvfrom(owner.socket, buffer, sizeof(buffer), 0, (sockaddr*)&addr, &addr_size);
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0 || terminated) break;
+			if (rate_limited(owner, addr)) continue;
+
+			{
+				std::lock_guard<std::mutex> _(owner.mutex);
+
+				process_datagram(owner, addr, buffer, n);
+				flush_acknowledges(owner);
+				++owner.receive_batch_histogram[1];
+			}
+		}
+	}
+
+	// runs receive, resend and application dispatch for one shard on the calling thread until terminated
+	// ready runs once a refused send can be retried, the loop blocks on epoll where wait_message would have been woken
+	bool event_loop(std::function<void(const Input_message&)> dispatch, int32 shard = 0, std::function<void()> ready = nullptr)
+	{
+		assert(state == State::Started);
+
+		Shard& owner = *shards[shard];
+
+		int32 flags = fcntl(owner.socket, F_GETFL, 0);
+		fcntl(owner.socket, F_SETFL, flags | O_NONBLOCK);
+
+		int32 epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll_fd < 0)
+		{
+			printf("Failed to create event loop");
+			return false;
+		}
+		int32 timer_fd = owner.timer_fd;
+
+		// with io_uring the ring descriptor turns readable on completions
+		int32 receive_fd = owner.uring.opened() ? owner.uring.descriptor() : owner.socket;
+
+		epoll_event event = { 0 };
+		event.events = EPOLLIN;
+		for (int32 fd : { receive_fd, timer_fd, wake_fd })
+		{
+			event.data.fd = fd;
+			epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+		}
+
+		Receive_batch batch;
+		batch.allocate(config.receive_batch_size);
+
+		if (owner.uring.opened())
+		{
+			std::lock_guard<std::mutex> _(owner.mutex);
+			owner.uring.submit();
+		}
+
+		std::vector<Input_message> messages;
+		epoll_event events[3];
+
+		while (!terminated)
+		{
+			int32 count = epoll_wait(epoll_fd, events, 3, -1);
+			if (count < 0 && errno != EINTR) break;
+
+			for (int32 i = 0; i < count && !terminated; ++i)
+			{
+				int32 fd = events[i].data.fd;
+				if (fd == receive_fd && owner.uring.opened())
+				{
+					if (reap_uring(owner) < 0) terminated = true;
+				}
+				else if (fd == owner.socket)
+				{
+					// a short batch means the socket is drained
+					while (receive_batch(owner, batch, MSG_DONTWAIT) == batch.headers.size());
+				}
+				else if (fd == timer_fd)
+				{
+					uint64 expirations;
+					read(timer_fd, &expirations, sizeof(expirations));
+					resend_expired(owner);
+				}
+			}
+
+			if (owner.uring.opened())
+			{
+				std::lock_guard<std::mutex> _(owner.mutex);
+				owner.uring.submit();
+			}
+
+			while (true)
+			{
+				Input_message queued;
+				while (owner.message_queue.try_pop(queued)) messages.push_back(queued);
+				// the pops made room, packages held back by the full queue follow before dispatch
+				if (!owner.delivery_stalled.load(std::memory_order_acquire)) break;
+				resume_delivery(owner);
+			}
+			for (auto& message : messages)
+			{
+				if (terminated) break;
+				dispatch(message);
+			}
+			messages.clear();
+
+			// acknowledges processed above are what drain the send queues, so readiness is raised on this thread
+			if (ready && !terminated && owner.send_ready_pending.load(std::memory_order_acquire)) ready();
+		}
+
+		close(epoll_fd);
+		return true;
+	}
+
+	std::string get_stats()
+	{
+		std::string result;
+		for (auto& shard : shards)
+		{
+			std::lock_guard<std::mutex> _(shard->mutex);
+
+			result += "Shard #" + std::to_string(shard->index) + ", " + std::to_string(shard->connections.size()) + " connections\n";
+			result += "Message queue depth " + std::to_string(shard->message_queue.size()) + "/" + std::to_string(shard->message_queue.capacity()) +
+				", high water " + std::to_string(shard->message_queue_high_water) +
+				", overflows " + std::to_string(shard->message_queue_overflows) + "\n";
+			result += "Acknowledges sent " + std::to_string(shard->acknowledges_sent) + ", " + std::to_string(shard->acknowledges_piggybacked) +
+				" more on data, for " + std::to_string(shard->data_received) + " data packages\n";
+			result += "Reorder held " + std::to_string(shard->reorder_held) + "/" + std::to_string(config.reorder_window) +
+				" per connection, high water " + std::to_string(shard->reorder_high_water) +
+				", overruns " + std::to_string(shard->reorder_overruns) + "\n";
+			result += "Delivered past a gap " + std::to_string(shard->unordered_early) + " unordered, " + std::to_string(shard->stream_early) +
+				" on their own stream, sequenced sent " + std::to_string(shard->sequenced_sent) +
+				", dropped " + std::to_string(shard->sequenced_stale) + " stale, " + std::to_string(shard->sequenced_overflows) + " on a full queue\n";
+			result += "Handshakes " + std::to_string(shard->handshakes) + ", " + std::to_string(shard->restarts) + " restarted, cookies sent " + std::to_string(shard->cookies_sent) +
+				", rejected " + std::to_string(shard->cookie_rejects) + ", dropped " + std::to_string(shard->unknown_drops) + " from unknown sources\n";
+			result += "Resets sent " + std::to_string(shard->resets_sent) + ", taken " + std::to_string(shard->resets_taken) +
+				", messages lost to them " + std::to_string(shard->reset_losses) + "\n";
+			if (shard->source_limiter.enabled() || shard->global_limiter.enabled())
+			{
+				result += "Rate limited " + std::to_string(shard->source_rate_drops) + " from a single source, " +
+					std::to_string(shard->global_rate_drops) + " over the global rate\n";
+			}
+			result += "Evicted " + std::to_string(shard->idle_evictions) + " idle and " + std::to_string(shard->limit_evictions) +
+				" over the connection limit, refused " + std::to_string(shard->limit_refusals) + " with only banned peers to evict, keepalives sent " +
+				std::to_string(shard->keepalives_sent) + "\n";
+			result += "Send window " + std::to_string(config.send_window) + ", queued " + std::to_string(shard->sends_queued) +
+				", would block " + std::to_string(shard->sends_would_block) + ", retransmissions " + std::to_string(shard->retransmissions) + "\n";
+			result += "Packet pool " + std::to_string(shard->packets.buffers_in_use) + " buffers, " +
+				std::to_string(shard->packets.bytes_in_use) + " bytes in use of " + std::to_string(shard->packets.reserved()) +
+				" reserved, high water " + std::to_string(shard->packets.high_water) + "\n";
+			result += "Reassembly " + std::to_string(shard->reassembly_bytes) + " bytes, dropped " + std::to_string(shard->reassembly_drops) +
+				" too long, " + std::to_string(shard->reassembly_timeouts) + " timed out\n";
+			if (config.coalesce_us > 0)
+			{
+				result += "Coalesced " + std::to_string(shard->coalesced_packages) + " packages into " +
+					std::to_string(shard->coalesced_datagrams) + " datagrams\n";
+			}
+			if (shard->uring_post_retries > 0)
+			{
+				result += "Receives left unposted on a full io_uring queue " + std::to_string(shard->uring_post_retries) + "\n";
+			}
+			if (shard->link.enabled())
+			{
+				result += "Link emulator dropped " + std::to_string(shard->link.random_drops) + " at random, " +
+					std::to_string(shard->link.queue_drops) + " on a full queue\n";
+			}
+			result += "Receive batch fill (datagrams: batches):\n";
+			auto& histogram = shard->receive_batch_histogram;
+			for (int32 i = 1; i < histogram.size(); ++i)
+			{
+				if (histogram[i] == 0) continue;
+				result += std::to_string(i) + ": " + std::to_string(histogram[i]) + "\n";
+			}
+		}
+		return result;
+	}
+
+	// optional address filter
+	// messages longer than Message_size_limit go out as fragments, all in the window or all queued
+	// ordered packages go out on the given stream, a loss only holds back later messages on the same one
+	Send_result send(Address address, const std::string& in_message, Delivery delivery = Delivery::Reliable_ordered, int32 stream = 0)
+	{
+		if (stream < 0 || stream >= Stream_limit) return Send_result::Bad_stream;
+		if (in_message.size() == 0) return Send_result::Sent;
+		if (in_message.size() > config.message_limit) return Send_result::Too_large;
+		if (delivery == Delivery::Unreliable_sequenced && in_message.size() > Message_size_limit) return Send_result::Too_large;
+
+		int32 fragments = (in_message.size() + Message_size_limit - 1) / Message_size_limit;
+
+		Shard& shard = route(address);
+		std::lock_guard<std::mutex> _(shard.mutex);
+
+		Connection* opened = obtain_connection(shard, address, Handshake::Hello);
+		if (!opened) return Send_result::Table_full;
+		Connection& connection = *opened;
+		if (delivery == Delivery::Unreliable_sequenced)
+		{
+			// nowhere to go yet, refused rather than lost so the caller can tell
+			if (connection.handshake == Handshake::Hello)
+			{
+				connection.send_blocked = true;
+				++shard.sends_would_block;
+				return Send_result::Would_block;
+			}
+			send_sequenced(shard, connection, in_message);
+			return Send_result::Sent;
+		}
+		if (stream != 0) connection.streamed = true;
+
+		int32 room = 0;
+		if (connection.send_queue.empty()) room = std::max<int32>(0, send_limit(connection) - connection.send_sessions.span());
+
+		int32 queued = std::max(0, fragments - room);
+		if (queued > 0 && !connection.send_queue.empty() && connection.send_queue.size() + queued > config.send_queue_limit)
+		{
+			connection.send_blocked = true;
+			++shard.sends_would_block;
+			return Send_result::Would_block;
+		}
+
+		for (int32 i = 0; i < fragments; ++i)
+		{
+			Package_view package;
+			package.type = i + 1 < fragments ? Package_type::Fragment : Package_type::Data;
+			if (fragments == 1 && delivery == Delivery::Reliable_unordered) package.type = Package_type::Unordered;
+			if (package.type != Package_type::Unordered)
+			{
+				package.streamed = connection.streamed;
+				package.stream = stream;
+				package.stream_sequence = connection.stream(stream).next_send++;
+			}
+			int32 offset = i * Message_size_limit;
+			package.payload = in_message.data() + offset;
+			package.length = std::min<int32>(Message_size_limit, in_message.size() - offset);
+
+			// serialized once here, the number is filled in when it goes out
+			Send_session session;
+			session.starts_message = i == 0;
+			session.size = package.size();
+			session.buffer = shard.packets.allocate(session.size);
+			package.serialize(shard.packets.data(session.buffer));
+
+			if (i < room) transmit(shard, connection, session);
+			else connection.send_queue.push_back(session);
+		}
+		if (room > 0 && shard.uring.opened()) shard.uring.submit();
+
+		if (queued == 0) return Send_result::Sent;
+		++shard.sends_queued;
+		return Send_result::Queued;
+	}
+
+	// false once the connection to the address was evicted, or before one was opened
+	bool connected(const Address& address)
+	{
+		Shard& shard = route(address);
+		std::lock_guard<std::mutex> _(shard.mutex);
+
+		return shard.connections.find(Connection_table::key(address.addr)) >= 0;
+	}
+
+	// true when sending a single package message to the address would not block
+	bool can_send(const Address& address)
+	{
+		Shard& shard = route(address);
+		std::lock_guard<std::mutex> _(shard.mutex);
+
+		Connection_handle handle = shard.connections.find(Connection_table::key(address.addr));
+		if (handle < 0) return true;
+		return shard.connections.get(handle).send_queue.size() < config.send_queue_limit;
+	}
+
+	// addresses that were refused by send and have room again, wait_message wakes when one appears
+	int32 send_ready(Address* out, int32 limit)
+	{
+		int32 taken = 0;
+		for (auto& shard : shards)
+		{
+			if (!shard->send_ready_pending.load(std::memory_order_acquire)) continue;
+
+			std::lock_guard<std::mutex> _(shard->mutex);
+			auto& ready = shard->send_ready;
+			int32 count = std::min<int32>(limit - taken, ready.size());
+			for (int32 i = 0; i < count; ++i) out[taken++] = ready[i];
+			ready.erase(ready.begin(), ready.begin() + count);
+			shard->send_ready_pending.store(!ready.empty(), std::memory_order_release);
+			if (taken == limit) break;
+		}
+		return taken;
+	}
+
+	bool has_message()
+	{
+		for (auto& shard : shards)
+		{
+			if (!shard->message_queue.empty()) return true;
+		}
+		return false;
+	}
+
+	bool has_send_ready()
+	{
+		for (auto& shard : shards)
+		{
+			if (shard->send_ready_pending.load(std::memory_order_acquire)) return true;
+		}
+		return false;
+	}
+
+	// sleeps until a message is queued, a blocked peer has room, the timeout passes or the server terminates
+	bool wait_message(Time timeout_ms)
+	{
+		if (has_message()) return true;
+
+		std::unique_lock<std::mutex> lock(message_wait_mutex);
+		message_waiters.fetch_add(1);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		message_wait.wait_for(lock, std::chrono::milliseconds(timeout_ms), [&] { return terminated || has_message() || has_send_ready(); });
+		message_waiters.fetch_sub(1);
+
+		return has_message();
+	}
+
+	// takes from shards in turn, each peer only ever lands on one shard so its order holds
+	Input_message next_message()
+	{
+		Input_message message;
+		bool found = next_messages(&message, 1) == 1;
+		assert(found && "next_message without a queued message");
+		return message;
+	}
+
+	// fills up to limit messages without taking any lock, returns how many were taken
+	int32 next_messages(Input_message* out, int32 limit)
+	{
+		int32 taken = 0;
+		for (int32 i = 0; i < shards.size() && taken < limit; ++i)
+		{
+			Shard& shard = *shards[(next_shard + i) % shards.size()];
+			int32 before = taken;
+			while (taken < limit && shard.message_queue.try_pop(out[taken])) ++taken;
+			if (taken > before && shard.delivery_stalled.load(std::memory_order_acquire)) resume_delivery(shard);
+		}
+		next_shard = (next_shard + 1) % shards.size();
+		return taken;
+	}
+
+	int32 queue_depth()
+	{
+		int32 depth = 0;
+		for (auto& shard : shards) depth += shard->message_queue.size();
+		return depth;
+	}
+
+	// packages sent or queued and not yet acknowledged, over all connections
+	int32 in_flight()
+	{
+		int32 count = 0;
+		for (auto& shard : shards)
+		{
+			std::lock_guard<std::mutex> _(shard->mutex);
+			for (auto& connection : shard->connections) count += connection.send_sessions.size() + connection.send_queue.size();
+		}
+		return count;
+	}
+
+	Time time_ms()
+	{
+		return std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	// CLOCK_MONOTONIC, the clock the retransmission timerfd runs on
+	Time monotonic_ms()
+	{
+		return monotonic_us() / 1000;
+	}
+
+	Time monotonic_us()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	void wait_ms(Time length_ms)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(length_ms));
+	}
+
+	bool debug_drop_next_input_package = false; // failure to receive (did not reach the server
+	bool debug_disable_next_immediate_send = false; // allows test wrong order & resend
+
+private:
+	// preallocated recvmmsg storage, one slot per datagram
+	struct Receive_batch
+	{
+		std::vector<char> buffers;
+		std::vector<sockaddr_in> addrs;
+		std::vector<iovec> iovecs;
+		std::vector<mmsghdr> headers;
+		// indices of the datagrams that passed the rate limits
+		std::vector<int32> admitted;
+
+		void allocate(int32 size)
+		{
+			buffers.resize(size * Datagram_limit);
+			admitted.resize(size);
+			addrs.resize(size);
+			iovecs.resize(size);
+			headers.resize(size);
+
+			for (int32 i = 0; i < size; ++i)
+			{
+				iovecs[i].iov_base = buffers.data() + i * Datagram_limit;
+				iovecs[i].iov_len = Datagram_limit;
+			}
+		}
+
+		void reset()
+		{
+			for (int32 i = 0; i < headers.size(); ++i)
+			{
+				headers[i] = mmsghdr{};
+				headers[i].msg_hdr.msg_name = &addrs[i];
+				headers[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+				headers[i].msg_hdr.msg_iov = &iovecs[i];
+				headers[i].msg_hdr.msg_iovlen = 1;
+			}
+		}
+	};
+
+	// one posted recvmsg or in-flight sendmsg
+	struct Uring_slot
+	{
+		char buffer[Datagram_limit];
+		sockaddr_in addr;
+		iovec iov;
+		msghdr header;
+
+		void prepare(int32 size)
+		{
+			iov.iov_base = buffer;
+			iov.iov_len = size;
+			header = msghdr{};
+			header.msg_name = &addr;
+			header.msg_namelen = sizeof(addr);
+			header.msg_iov = &iov;
+			header.msg_iovlen = 1;
+		}
+	};
+
+	static constexpr uint64 Uring_send_tag = uint64{ 1 } << 32;
+	// marks timer wheel entries that expire a reassembly instead of retransmitting
+	static constexpr uint64 Reassembly_tag = uint64{ 1 } << 63;
+	// and ones that repeat a Hello
+	static constexpr uint64 Handshake_tag = uint64{ 1 } << 62;
+	// a cookie stays valid for the slot it was issued in and the next one
+	static constexpr Time Cookie_period_ms = 30000;
+
+	// one socket and everything its peers need, shards never touch each other's state
+	struct Shard
+	{
+		int32 index{ 0 };
+		Socket socket{ -1 };
+
+		Connection_table connections;
+		std::vector<Connection_handle> pending_acknowledges;
+		uint64 data_received{ 0 };
+		uint64 acknowledges_sent{ 0 };
+		uint64 acknowledges_piggybacked{ 0 };
+		// connections owing a delayed acknowledge, the earliest deadline among them
+		std::vector<Connection_handle> delayed_acknowledges;
+		Time acknowledge_deadline_us{ 0 };
+		// packages currently held in reorder windows, the fullest single window, drops past the window
+		int32 reorder_held{ 0 };
+		int32 reorder_high_water{ 0 };
+		uint64 reorder_overruns{ 0 };
+		// unordered and stream packages delivered past a gap, sequenced ones sent, dropped as stale or on a full queue
+		uint64 unordered_early{ 0 };
+		uint64 stream_early{ 0 };
+		uint64 sequenced_sent{ 0 };
+		uint64 sequenced_stale{ 0 };
+		uint64 sequenced_overflows{ 0 };
+		// cookies that admitted a connection, cookies sent, echoes that failed, other packages from unknown sources
+		uint64 handshakes{ 0 };
+		uint64 cookies_sent{ 0 };
+		uint64 cookie_rejects{ 0 };
+		uint64 unknown_drops{ 0 };
+		// admitted again under a new incarnation, the old connection evicted
+		uint64 restarts{ 0 };
+		// answers to unknown peers, connections started over on one, messages that could not be resent whole
+		uint64 resets_sent{ 0 };
+		uint64 resets_taken{ 0 };
+		uint64 reset_losses{ 0 };
+		// next walk over the quiet connections, 0 while there are none
+		Time sweep_deadline_us{ 0 };
+		uint64 idle_evictions{ 0 };
+		uint64 limit_evictions{ 0 };
+		uint64 limit_refusals{ 0 };
+		uint64 keepalives_sent{ 0 };
+		// connections whose held packages wait for room in the message queue
+		std::vector<Connection_handle> stalled_connections;
+		std::atomic<bool> delivery_stalled{ false };
+
+		uint64 retransmissions{ 0 };
+		Link_emulator link;
+		// inbound datagrams are checked against both before the shard is locked, only the receiving thread touches them
+		Rate_limiter source_limiter;
+		Rate_limiter global_limiter;
+		// counted outside the lock, read by get_stats
+		std::atomic<uint64> source_rate_drops{ 0 };
+		std::atomic<uint64> global_rate_drops{ 0 };
+		// serialized packages in flight or queued, referenced from the send sessions
+		Packet_pool packets;
+
+		// connections with a pending coalesced datagram, the earliest deadline among them
+		std::vector<Connection_handle> coalescing;
+		Time coalesce_deadline_us{ 0 };
+		uint64 coalesced_packages{ 0 };
+		uint64 coalesced_datagrams{ 0 };
+
+		// bytes of partly received messages, messages dropped for length or timeout
+		int64_t reassembly_bytes{ 0 };
+		uint64 reassembly_drops{ 0 };
+		uint64 reassembly_timeouts{ 0 };
+
+		uint64 sends_queued{ 0 };
+		uint64 sends_would_block{ 0 };
+		// connections unblocked since the last send_ready call
+		std::vector<Address> send_ready;
+		std::atomic<bool> send_ready_pending{ false };
+
+		Ring<Input_message> message_queue;
+		uint64 message_queue_overflows{ 0 };
+		int32 message_queue_high_water{ 0 };
+		std::mutex mutex;
+
+		std::vector<uint64> receive_batch_histogram;
+
+		Timer_wheel retransmit_timers;
+		int32 timer_fd{ -1 };
+		Time timer_deadline_us{ 0 };
+
+		Uring uring;
+		std::unique_ptr<Uring_slot[]> uring_receives;
+		std::unique_ptr<Uring_slot[]> uring_sends;
+		std::vector<int32> uring_free_sends;
+		int32 uring_receive_depth{ 0 };
+		// receive slots that found the submission queue full, posted again after the next reap
+		std::vector<int32> uring_unposted;
+		uint64 uring_post_retries{ 0 };
+
+		~Shard()
+		{
+			if (timer_fd >= 0) close(timer_fd);
+		}
+	};
+
+	bool open_shard(Shard& shard, bool reuse_port)
+	{
+		shard.receive_batch_histogram.assign(config.receive_batch_size + 1, 0);
+		shard.message_queue.allocate(config.message_queue_capacity);
+
+		shard.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (shard.timer_fd < 0)
+		{
+			printf("Failed to create retransmission timer");
+			return false;
+		}
+		shard.retransmit_timers.start(monotonic_ms());
+		shard.link.configure(config.emulate_loss, config.emulate_delay_ms, config.emulate_rate, config.emulate_queue, monotonic_us() + shard.index);
+		// each shard takes its share of the global rate, a peer only ever lands on one
+		int32 shard_count = is_server ? config.shards : 1;
+		shard.source_limiter.configure(config.source_rate, config.source_burst, Rate_bucket_count, cookie_key);
+		int32 global_share = (config.global_rate + shard_count - 1) / shard_count;
+		shard.global_limiter.configure(global_share, std::max(1, config.global_burst / shard_count), 1, cookie_key);
+
+		shard.socket = socket(AF_INET, SOCK_DGRAM, 0);
+		if (shard.socket < 0)
+		{
+			printf("Failed to open server socket");
+			return false;
+		}
+
+		sockaddr_in addr_server = { 0 };
+		addr_server.sin_family = AF_INET;
+		addr_server.sin_addr.s_addr = INADDR_ANY;
+		addr_server.sin_port = address_server.addr.sin_port;
+
+		int32 level = 1;
+		auto setsockopt_result = setsockopt(shard.socket, SOL_SOCKET, SO_BROADCAST, &level, sizeof(level));
+		if (setsockopt_result < 0)
+		{
+			printf("Failed to setsockopt server socket");
+			return false;
+		}
+
+		// the kernel hashes each peer to one of the sockets sharing the port
+		if (reuse_port && setsockopt(shard.socket, SOL_SOCKET, SO_REUSEPORT, &level, sizeof(level)) < 0)
+		{
+			printf("Failed to set SO_REUSEPORT on server socket");
+			return false;
+		}
+
+		if (is_server)
+		{
+			auto result_bind = bind(shard.socket, (sockaddr*)&addr_server, sizeof(addr_server));
+			if (result_bind < 0)
+			{
+				printf("Failed to bind server socket");
+				return false;
+			}
+		}
+
+		if (config.uring)
+		{
+			if (shard.uring.open(Uring_queue_depth)) post_uring_slots(shard);
+			else printf("io_uring is not available, using sockets\n");
+		}
+
+		return true;
+	}
+
+	void close_shards()
+	{
+		for (auto& shard : shards)
+		{
+			if (shard->socket < 0) continue;
+			shutdown(shard->socket, 2);
+			close(shard->socket);
+			shard->socket = -1;
+		}
+	}
+
+	// replies carry the shard they arrived on, anything else is looked up
+	Shard& route(const Address& address)
+	{
+		if (shards.size() == 1) return *shards[0];
+		if (address.shard >= 0 && address.shard < shards.size()) return *shards[address.shard];
+
+		uint64 key = Connection_table::key(address.addr);
+		for (auto& shard : shards)
+		{
+			std::lock_guard<std::mutex> _(shard->mutex);
+
+			if (shard->connections.find(key) >= 0) return *shard;
+		}
+		return *shards[key % shards.size()];
+	}
+
+	static uint64 retransmit_tag(Connection_handle handle, Package_number number)
+	{
+		return (uint64(uint32(handle)) << 32) | uint32(number);
+	}
+
+	// expects shard.mutex to be held
+	int32 arm_retransmit(Shard& shard, Connection& connection, Package_number number, Time now)
+	{
+		Time expires = now + connection.rtt.rto_ms;
+		int32 timer = shard.retransmit_timers.arm(now, expires, retransmit_tag(connection.handle, number));
+		schedule_earlier(shard, expires * 1000);
+		return timer;
+	}
+
+	void schedule_earlier(Shard& shard, Time deadline_us)
+	{
+		if (shard.timer_deadline_us == 0 || deadline_us < shard.timer_deadline_us) schedule_timer(shard, deadline_us);
+	}
+
+	// points the timerfd at an absolute monotonic deadline in microseconds, 0 disarms it
+	void schedule_timer(Shard& shard, Time deadline_us)
+	{
+		shard.timer_deadline_us = deadline_us;
+
+		itimerspec spec = { 0 };
+		spec.it_value.tv_sec = deadline_us / 1000000;
+		spec.it_value.tv_nsec = (deadline_us % 1000000) * 1000;
+		timerfd_settime(shard.timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+	}
+
+	// only touches the sessions whose timers fired, also drives the link emulator and coalescing deadlines
+	void resend_expired(Shard& shard)
+	{
+		std::lock_guard<std::mutex> _(shard.mutex);
+
+		Time now = monotonic_ms();
+		shard.retransmit_timers.advance(now, [&](uint64 tag)
+		{
+			Connection& connection = shard.connections.get((tag & ~(Reassembly_tag | Handshake_tag)) >> 32);
+			if (tag & Handshake_tag)
+			{
+				connection.handshake_timer = -1;
+				if (connection.handshake != Handshake::Hello) return;
+				connection.rtt.backoff(config.rto_max_ms);
+				connection.hello_sent_us = 0;
+				send_hello(shard, connection);
+				return;
+			}
+			if (tag & Reassembly_tag)
+			{
+				expire_reassembly(shard, connection, uint32(tag), now);
+				return;
+			}
+			Package_number number = uint32(tag);
+
+			Send_session* session = connection.send_sessions.find(number);
+			if (!session) return;
+
+			if (config.trace) printf("Package #%u to %s was not acknowledged within timeout, resending\n", number, connection.address.to_string().c_str());
+
+			// like a single per-connection timer, only the oldest package in flight doubles the timeout
+			if (number == connection.send_sessions.oldest())
+			{
+				connection.rtt.backoff(config.rto_max_ms);
+				connection.congestion->on_loss();
+			}
+			++session->retransmits;
+			++shard.retransmissions;
+			send_package(shard, connection, *session);
+			session->timer = shard.retransmit_timers.arm(now, now + connection.rtt.rto_ms, tag);
+		});
+
+		Time now_us = monotonic_us();
+		if (shard.acknowledge_deadline_us != 0 && shard.acknowledge_deadline_us <= now_us) flush_delayed_acknowledges(shard, now_us);
+		if (shard.coalesce_deadline_us != 0 && shard.coalesce_deadline_us <= now_us) flush_coalesced(shard, now_us);
+		if (shard.sweep_deadline_us != 0 && shard.sweep_deadline_us <= now_us) sweep_idle(shard, now);
+
+		shard.link.release(now_us, [&](const Link_emulator::Datagram& datagram)
+		{
+			sendto(shard.socket, datagram.buffer, datagram.size, 0, (const sockaddr*)&datagram.addr, sizeof(datagram.addr));
+		});
+
+		Time deadline_us = shard.retransmit_timers.next_expiry() * 1000;
+		for (Time other : { shard.link.next_release_us(), shard.coalesce_deadline_us, shard.acknowledge_deadline_us, shard.sweep_deadline_us })
+		{
+			if (other != 0 && (deadline_us == 0 || other < deadline_us)) deadline_us = other;
+		}
+		schedule_timer(shard, deadline_us);
+
+		if (shard.uring.opened()) shard.uring.submit();
+	}
+
+	void listen_batched(Shard& shard)
+	{
+		Receive_batch batch;
+		batch.allocate(config.receive_batch_size);
+
+		while (!terminated)
+		{
+			// blocks for the first datagram only, then takes whatever is already queued
+			int32 n = receive_batch(shard, batch, MSG_WAITFORONE);
+			if (n <= 0 || terminated) break;
+		}
+	}
+
+	// pulls up to receive_batch_size datagrams per syscall and handles them under one lock
+	int32 receive_batch(Shard& shard, Receive_batch& batch, int32 flags)
+	{
+		batch.reset();
+
+		int32 n = recvmmsg(shard.socket, batch.headers.data(), batch.headers.size(), flags, nullptr);
+		if (n <= 0 || terminated) return n;
+
+		// a batch the limits drop entirely never contends for the shard
+		int32 admitted = 0;
+		for (int32 i = 0; i < n; ++i)
+		{
+			if (!rate_limited(shard, batch.addrs[i])) batch.admitted[admitted++] = i;
+		}
+		if (admitted == 0) return n;
+
+		{
+			std::lock_guard<std::mutex> _(shard.mutex);
+
+			for (int32 k = 0; k < admitted; ++k)
+			{
+				int32 i = batch.admitted[k];
+				process_datagram(shard, batch.addrs[i], (const char*)batch.iovecs[i].iov_base, batch.headers[i].msg_len);
+			}
+			flush_acknowledges(shard);
+			++shard.receive_batch_histogram[n];
+		}
+		return n;
+	}
+
+	// handshake is Hello when we open the connection, Done when the peer's cookie admitted it
+	// nullptr when a new connection would need a slot and only banned ones could be evicted
+	Connection* obtain_connection(Shard& shard, const Address& address, Handshake handshake)
+	{
+		uint64 key = Connection_table::key(address.addr);
+		Connection_handle handle = shard.connections.find(key);
+		if (handle < 0)
+		{
+			if (shard.connections.size() >= config.connection_limit / shards.size())
+			{
+				// a ban outlasts any quiet period, banned peers are passed over
+				Connection_handle oldest = shard.connections.oldest();
+				while (oldest >= 0 && shard.connections.get(oldest).banned) oldest = shard.connections.newer(oldest);
+				if (oldest < 0)
+				{
+					++shard.limit_refusals;
+					return nullptr;
+				}
+				++shard.limit_evictions;
+				evict(shard, shard.connections.get(oldest));
+			}
+
+			Connection connection;
+			connection.address = address;
+			connection.address.shard = shard.index;
+			connection.handshake = handshake;
+			connection.last_active_ms = monotonic_ms();
+			if (handshake == Handshake::Hello) connection.incarnation = new_incarnation();
+			connection.congestion = make_congestion(config.congestion, config.send_window);
+			connection.send_sessions.reserve(config.send_window);
+			handle = shard.connections.insert(key, std::move(connection));
+			shard.connections.get(handle).handle = handle;
+			if (handshake == Handshake::Hello)
+			{
+				shard.connections.get(handle).hello_sent_us = monotonic_us();
+				send_hello(shard, shard.connections.get(handle));
+			}
+			if (shard.sweep_deadline_us == 0) schedule_sweep(shard, monotonic_ms());
+		}
+
+		return &shard.connections.get(handle);
+	}
+
+	// frees the sessions, buffers, timers and held packages of the connection, its handle is reused
+	void evict(Shard& shard, Connection& connection)
+	{
+		if (config.trace) printf("Evicting connection to %s\n", connection.address.to_string().c_str());
+
+		connection.send_sessions.for_each([&](Send_session& session)
+		{
+			shard.retransmit_timers.cancel(session.timer);
+			shard.packets.release(session.buffer);
+		});
+		for (Send_session& session : connection.send_queue) shard.packets.release(session.buffer);
+
+		// the handle may be taken by the next connection, nothing should still point at it
+		drop_shard_state(shard, connection);
+		shard.connections.erase(Connection_table::key(connection.address.addr));
+	}
+
+	// returns what the shard accounts to the connection past its send sessions, and takes its handle off the work lists
+	void drop_shard_state(Shard& shard, Connection& connection)
+	{
+		auto drop_reassembly = [&](Stream_state& stream)
+		{
+			if (stream.reassembly.timer >= 0) shard.retransmit_timers.cancel(stream.reassembly.timer);
+			shard.reassembly_bytes -= stream.reassembly.data.size();
+		};
+		drop_reassembly(connection.first_stream);
+		for (Stream_state& stream : connection.more_streams) drop_reassembly(stream);
+
+		if (connection.handshake_timer >= 0) shard.retransmit_timers.cancel(connection.handshake_timer);
+		shard.reorder_held -= connection.reorder.occupancy();
+		connection.reorder.clear(shard.packets);
+
+		Connection_handle handle = connection.handle;
+		for (auto* list : { &shard.pending_acknowledges, &shard.delayed_acknowledges, &shard.coalescing, &shard.stalled_connections })
+		{
+			list->erase(std::remove(list->begin(), list->end(), handle), list->end());
+		}
+	}
+
+	// the peer answered with a reset, it holds no connection for us: a new one is opened and whole unacknowledged messages go out on it
+	void start_over(Shard& shard, Connection& connection)
+	{
+		++shard.resets_taken;
+		if (config.trace) printf("%s lost the connection, opening a new one\n", connection.address.to_string().c_str());
+
+		// in number order, queued sessions numbered as if they followed the ones in flight
+		std::vector<Send_session> unsent;
+		connection.send_sessions.for_each([&](Send_session& session)
+		{
+			shard.retransmit_timers.cancel(session.timer);
+			unsent.push_back(session);
+		});
+		Package_number next = connection.send_sessions.next();
+		for (Send_session session : connection.send_queue)
+		{
+			session.number = next++;
+			unsent.push_back(session);
+		}
+
+		// the new connection counts every stream from 0
+		std::deque<Send_session> queue;
+		uint16 sequences[Stream_limit] = { 0 };
+		int32 lost = 0;
+		auto drop = [&](int32 from, int32 to)
+		{
+			for (int32 i = from; i < to; ++i) shard.packets.release(unsent[i].buffer);
+			if (from < to) ++lost;
+		};
+
+		// a message missing an acknowledged fragment cannot be completed, the peer dropped what it had of it
+		int32 begin = 0;
+		bool whole = false;
+		for (int32 i = 0; i < unsent.size(); ++i)
+		{
+			Send_session& session = unsent[i];
+			if (session.starts_message)
+			{
+				drop(begin, i);
+				begin = i;
+				whole = true;
+			}
+			else if (i == 0 || session.number != unsent[i - 1].number + 1) whole = false;
+
+			Package_view view;
+			view.parse(shard.packets.data(session.buffer), session.size);
+			if (view.type == Package_type::Fragment) continue;
+
+			if (!whole)
+			{
+				drop(begin, i + 1);
+			}
+			else
+			{
+				for (int32 j = begin; j <= i; ++j)
+				{
+					Send_session kept = unsent[j];
+					char* buffer = shard.packets.data(kept.buffer);
+					view.parse(buffer, kept.size);
+					if (view.type != Package_type::Unordered)
+					{
+						uint16 sequence = sequences[view.stream]++;
+						if (view.streamed) Package_view::resequence(buffer, sequence);
+					}
+					kept.timer = -1;
+					kept.retransmits = 0;
+					queue.push_back(kept);
+				}
+			}
+			begin = i + 1;
+		}
+		drop(begin, unsent.size());
+
+		shard.reset_losses += lost;
+		if (lost > 0) printf("Lost %d partly acknowledged messages to %s, it dropped the connection\n", lost, connection.address.to_string().c_str());
+
+		drop_shard_state(shard, connection);
+
+		Connection fresh;
+		fresh.address = connection.address;
+		fresh.handle = connection.handle;
+		fresh.handshake = Handshake::Hello;
+		fresh.incarnation = new_incarnation();
+		fresh.last_active_ms = connection.last_active_ms;
+		fresh.rtt = connection.rtt;
+		fresh.congestion = make_congestion(config.congestion, config.send_window);
+		fresh.streamed = connection.streamed;
+		fresh.send_sessions.reserve(config.send_window);
+		fresh.send_queue.swap(queue);
+		fresh.send_blocked = connection.send_blocked;
+		for (int32 i = 0; i < Stream_limit; ++i)
+		{
+			if (sequences[i] != 0) fresh.stream(i).next_send = sequences[i];
+		}
+		connection = std::move(fresh);
+
+		connection.hello_sent_us = monotonic_us();
+		send_hello(shard, connection);
+	}
+
+	// picked by the opening side, unpredictable so a stale or forged echo does not match
+	uint32 new_incarnation()
+	{
+		Time now_us = monotonic_us();
+		return uint32(siphash(cookie_key, (const char*)&now_us, sizeof(now_us)));
+	}
+
+	void schedule_sweep(Shard& shard, Time now)
+	{
+		Time period = 0;
+		for (Time interval : { config.keepalive_ms, config.idle_timeout_ms })
+		{
+			if (interval != 0 && (period == 0 || interval < period)) period = interval;
+		}
+		if (period == 0) return;
+
+		// a quarter of the shorter interval, so probes and evictions run at most that late
+		shard.sweep_deadline_us = (now + std::max<Time>(period / 4, 1)) * 1000;
+		schedule_earlier(shard, shard.sweep_deadline_us);
+	}
+
+	// walks the connections from the least recently active and stops at the first one that is not quiet yet
+	void sweep_idle(Shard& shard, Time now)
+	{
+		Time quiet_ms = config.keepalive_ms != 0 ? config.keepalive_ms : config.idle_timeout_ms;
+		if (config.idle_timeout_ms != 0) quiet_ms = std::min(quiet_ms, config.idle_timeout_ms);
+
+		Connection_handle handle = shard.connections.oldest();
+		while (handle >= 0)
+		{
+			Connection& connection = shard.connections.get(handle);
+			handle = shard.connections.newer(handle);
+
+			Time idle = now - connection.last_active_ms;
+			if (idle < quiet_ms) break;
+
+			// a banned peer stays banned however long it is quiet
+			if (config.idle_timeout_ms != 0 && idle >= config.idle_timeout_ms && !connection.banned)
+			{
+				++shard.idle_evictions;
+				evict(shard, connection);
+			}
+			else if (config.keepalive_ms != 0 && connection.handshake != Handshake::Hello && !connection.banned && now >= connection.probe_due_ms)
+			{
+				send_keepalive(shard, connection);
+				connection.probe_due_ms = now + config.keepalive_ms;
+			}
+		}
+
+		// evictions and quiet periods leave whole slabs free, resident memory follows the load back down
+		shard.packets.trim();
+
+		shard.sweep_deadline_us = 0;
+		if (shard.connections.size() > 0) schedule_sweep(shard, now);
+	}
+
+	void send_keepalive(Shard& shard, Connection& connection)
+	{
+		Package_view package;
+		package.type = Package_type::Keepalive;
+
+		char buffer[Datagram_limit];
+		int32 size = package.serialize(buffer);
+		send_package(shard, connection, buffer, size);
+		++shard.keepalives_sent;
+	}
+
+	uint32 cookie_slot()
+	{
+		return uint32(monotonic_ms() / Cookie_period_ms);
+	}
+
+	Cookie_payload make_cookie(const sockaddr_in& addr, uint32 slot, uint32 incarnation)
+	{
+		char input[14];
+		uint32 wire_slot = htole32(slot);
+		uint32 wire_incarnation = htole32(incarnation);
+		bcopy(&addr.sin_addr.s_addr, input, 4);
+		bcopy(&addr.sin_port, input + 4, 2);
+		bcopy(&wire_slot, input + 6, 4);
+		bcopy(&wire_incarnation, input + 10, 4);
+
+		Cookie_payload cookie;
+		cookie.slot = wire_slot;
+		cookie.incarnation = wire_incarnation;
+		cookie.mac = htole64(siphash(cookie_key, input, sizeof(input)));
+		return cookie;
+	}
+
+	static bool read_cookie(const Package_view& package, Cookie_payload& out)
+	{
+		if (package.length != sizeof(Cookie_payload)) return false;
+		bcopy(package.payload, &out, sizeof(out));
+		return true;
+	}
+
+	// one hash, the slot in the cookie says which one to recompute
+	bool valid_cookie(const sockaddr_in& addr, const Cookie_payload& cookie)
+	{
+		uint32 slot = le32toh(cookie.slot);
+		uint32 now = cookie_slot();
+		if (slot != now && slot + 1 != now) return false;
+
+		return make_cookie(addr, slot, le32toh(cookie.incarnation)).mac == cookie.mac;
+	}
+
+	void send_cookie(Shard& shard, const sockaddr_in& addr, uint32 incarnation)
+	{
+		Cookie_payload cookie = make_cookie(addr, cookie_slot(), incarnation);
+
+		Package_view package;
+		package.type = Package_type::Cookie;
+		package.payload = (const char*)&cookie;
+		package.length = sizeof(cookie);
+
+		char buffer[Datagram_limit];
+		int32 size = package.serialize(buffer);
+		send_datagram(shard, addr, buffer, size);
+		++shard.cookies_sent;
+	}
+
+	void send_reset(Shard& shard, const sockaddr_in& addr)
+	{
+		Package_view package;
+		package.type = Package_type::Reset;
+
+		char buffer[Datagram_limit];
+		int32 size = package.serialize(buffer);
+		send_datagram(shard, addr, buffer, size);
+		++shard.resets_sent;
+	}
+
+	// asks the peer for a cookie, repeated with backoff until one arrives
+	void send_hello(Shard& shard, Connection& connection)
+	{
+		// as long as the cookie, so answering never sends more than was received
+		Cookie_payload hello{};
+		hello.incarnation = htole32(connection.incarnation);
+
+		Package_view package;
+		package.type = Package_type::Hello;
+		package.payload = (const char*)&hello;
+		package.length = sizeof(hello);
+
+		char buffer[Datagram_limit];
+		int32 size = package.serialize(buffer);
+		send_datagram(shard, connection.address.addr, buffer, size);
+		if (shard.uring.opened()) shard.uring.submit();
+
+		Time now = monotonic_ms();
+		Time expires = now + connection.rtt.rto_ms;
+		connection.handshake_timer = shard.retransmit_timers.arm(now, expires, Handshake_tag | retransmit_tag(connection.handle, 0));
+		schedule_earlier(shard, expires * 1000);
+	}
+
+	// a source over its own rate does not use up the global one, so a single flood cannot starve the others
+	// called by the shard's receiving thread, with or without shard.mutex
+	bool rate_limited(Shard& shard, const sockaddr_in& addr)
+	{
+		if (!shard.source_limiter.enabled() && !shard.global_limiter.enabled()) return false;
+
+		Time now_us = monotonic_us();
+		if (!shard.source_limiter.admit(Connection_table::key(addr), now_us))
+		{
+			++shard.source_rate_drops;
+			return true;
+		}
+		if (!shard.global_limiter.admit(0, now_us))
+		{
+			++shard.global_rate_drops;
+			return true;
+		}
+		return false;
+	}
+
+	// a source without a connection gets one only by echoing a valid cookie, nothing is kept before that
+	bool admit(Shard& shard, const Address& address, const Package_view& first)
+	{
+		Cookie_payload cookie;
+		bool asks = (first.type == Package_type::Hello || first.type == Package_type::Cookie) && read_cookie(first, cookie);
+		if (asks && first.type == Package_type::Cookie && valid_cookie(address.addr, cookie))
+		{
+			++shard.handshakes;
+			return true;
+		}
+
+		if (asks) send_cookie(shard, address.addr, le32toh(cookie.incarnation));
+		// the peer still holds a connection we evicted or never had, it should open a new one; a reset is never answered
+		else if (first.type != Package_type::Hello && first.type != Package_type::Cookie && first.type != Package_type::Reset) send_reset(shard, address.addr);
+
+		if (first.type == Package_type::Cookie) ++shard.cookie_rejects;
+		else if (first.type != Package_type::Hello) ++shard.unknown_drops;
+		if (config.trace && first.type != Package_type::Hello) printf("Dropping package from unknown source %s\n", address.to_string().c_str());
+		return false;
+	}
+
+	// a valid cookie from another incarnation of the peer, it lost the connection and started over
+	bool restarted(const Connection& connection, const Package_view& package)
+	{
+		Cookie_payload cookie;
+		if (connection.handshake != Handshake::Done || connection.banned || !read_cookie(package, cookie)) return false;
+		return le32toh(cookie.incarnation) != connection.incarnation && valid_cookie(connection.address.addr, cookie);
+	}
+
+	// the peer answered a Hello, queued sends can go out behind the cookie
+	void receive_cookie(Shard& shard, Connection& connection, const Package_view& package)
+	{
+		// an echo that arrived after the connection was admitted
+		if (connection.handshake == Handshake::Done || package.length != sizeof(Cookie_payload)) return;
+
+		bcopy(package.payload, &connection.cookie, sizeof(connection.cookie));
+		connection.handshake = Handshake::Echo;
+		if (connection.handshake_timer >= 0) shard.retransmit_timers.cancel(connection.handshake_timer);
+		connection.handshake_timer = -1;
+		// the first round trip, unless Karn rules it out
+		if (connection.hello_sent_us != 0) connection.rtt.sample(monotonic_us() - connection.hello_sent_us, config.rto_min_ms, config.rto_max_ms);
+		connection.hello_sent_us = 0;
+
+		release_send_queue(shard, connection);
+		if (shard.uring.opened()) shard.uring.submit();
+	}
+
+	// expects shard.mutex to be held, and the datagram to have passed rate_limited
+	// a datagram carries one package or several coalesced back to back
+	void process_datagram(Shard& shard, const sockaddr_in& addr, const char* buffer, int32 size)
+	{
+		Package_view first;
+		if (first.parse(buffer, size) == 0)
+		{
+			if (config.trace) printf("Dropping malformed package of %d bytes\n", size);
+			return;
+		}
+
+		Address address{ addr };
+		address.shard = shard.index;
+
+		Connection_handle handle = shard.connections.find(Connection_table::key(addr));
+		if (handle >= 0 && first.type == Package_type::Cookie && restarted(shard.connections.get(handle), first))
+		{
+			++shard.restarts;
+			evict(shard, shard.connections.get(handle));
+			handle = -1;
+		}
+		if (handle < 0 && !admit(shard, address, first)) return;
+
+		Connection* admitted = obtain_connection(shard, address, Handshake::Done);
+		if (!admitted) return;
+		Connection& connection = *admitted;
+		if (handle < 0)
+		{
+			Cookie_payload cookie;
+			read_cookie(first, cookie);
+			connection.incarnation = le32toh(cookie.incarnation);
+		}
+		if (first.type == Package_type::Reset)
+		{
+			// a live peer keeps answering, so a forged reset cannot restart a connection in use; not counted as activity
+			bool quiet = monotonic_ms() - connection.last_active_ms >= connection.rtt.rto_ms;
+			if (connection.handshake != Handshake::Hello && !connection.banned && quiet) start_over(shard, connection);
+			return;
+		}
+		connection.last_active_ms = monotonic_ms();
+		connection.probe_due_ms = 0;
+		shard.connections.touch(connection.handle);
+
+		bool skip = false;
+		if (debug_drop_next_input_package)
+		{
+			skip = true;
+			debug_drop_next_input_package = false;
+		}
+		if (connection.banned || skip)
+		{
+			if (config.trace) printf("Dropping package from %s\n", address.to_string().c_str());
+			return;
+		}
+
+		if (config.trace) printf("Processing package from %s\n", address.to_string().c_str());
+
+		while (size > 0)
+		{
+			Package_view package;
+			int32 consumed = package.parse(buffer, size);
+			if (consumed == 0)
+			{
+				if (config.trace) printf("Dropping malformed tail of %d bytes\n", size);
+				return;
+			}
+
+			process_package(shard, connection, address, package);
+
+			buffer += consumed;
+			size -= consumed;
+		}
+	}
+
+	void process_package(Shard& shard, Connection& connection, const Address& address, const Package_view& package)
+	{
+		// anything past the handshake shows the peer holds the connection, stop echoing the cookie
+		bool handshake = package.type == Package_type::Hello || package.type == Package_type::Cookie;
+		if (connection.handshake == Handshake::Echo && !handshake) connection.handshake = Handshake::Done;
+
+		if (package.type == Package_type::Acknowledge)
+		{
+			process_acknowledge(shard, connection, package);
+			return;
+		}
+		if (package.type == Package_type::Hello)
+		{
+			// the peer lost its connection, its echo of this cookie replaces the old one
+			Cookie_payload hello;
+			if (read_cookie(package, hello)) send_cookie(shard, connection.address.addr, le32toh(hello.incarnation));
+			return;
+		}
+		if (package.type == Package_type::Cookie)
+		{
+			receive_cookie(shard, connection, package);
+			return;
+		}
+
+		// only taken as the first package of a datagram
+		if (package.type == Package_type::Reset) return;
+
+		if (package.type == Package_type::Keepalive)
+		{
+			if (!connection.acknowledge_pending)
+			{
+				connection.acknowledge_pending = true;
+				shard.pending_acknowledges.push_back(connection.handle);
+			}
+			return;
+		}
+
+		if (package.type == Package_type::Sequenced)
+		{
+			process_sequenced(shard, connection, address, package);
+			return;
+		}
+
+		++shard.data_received;
+
+		Reorder_window& reorder = connection.reorder;
+		int32 offset = sequence_distance(connection.number_receive, package.number);
+		// anything else tells the sender about a gap or a lost acknowledge, so it goes out with the batch
+		bool in_order = offset == 0 && reorder.held == 0;
+
+		if (offset < 0)
+		{
+			if (config.trace) printf("Package #%u already received, resending acknowledge\n", package.number);
+		}
+		else if (offset >= config.reorder_window)
+		{
+			// beyond what the window can hold, the sender retransmits it later
+			++shard.reorder_overruns;
+			if (config.trace) printf("Dropping package #%u, next package number is #%u\n", package.number, connection.number_receive);
+			return;
+		}
+		else if (reorder.holds(offset))
+		{
+			if (config.trace) printf("Package #%u already held, resending acknowledge\n", package.number);
+		}
+		else if (offset == 0 && reorder.held == 0 && shard.message_queue.size() < shard.message_queue.capacity())
+		{
+			// in order with nothing held, the common case skips the window
+			accept_package(shard, connection, address, package);
+			++connection.number_receive;
+		}
+		else if (package.type == Package_type::Unordered && shard.message_queue.size() < shard.message_queue.capacity())
+		{
+			// goes out past the gap now, the window only remembers the number
+			push_message(shard, address, std::string(package.payload, package.length));
+			reorder.mark_delivered(shard.packets, package.number, offset);
+			++shard.reorder_held;
+			++shard.unordered_early;
+		}
+		else if (offset > 0 && package.streamed && package.stream_sequence == connection.stream(package.stream).next_receive &&
+			shard.message_queue.size() < shard.message_queue.capacity())
+		{
+			// next on its own stream, the gap in front belongs to another one
+			accept_package(shard, connection, address, package);
+			reorder.mark_delivered(shard.packets, package.number, offset);
+			++shard.reorder_held;
+			++shard.stream_early;
+			deliver_stream(shard, connection, address, package.stream);
+		}
+		else
+		{
+			if (config.trace && offset > 0) printf("Holding package #%u, next package number is #%u\n", package.number, connection.number_receive);
+			reorder.store(shard.packets, package, offset, config.reorder_window);
+			++shard.reorder_held;
+			shard.reorder_high_water = std::max(shard.reorder_high_water, reorder.occupancy());
+		}
+
+		deliver_held(shard, connection, address);
+
+		if (in_order && config.acknowledge_delay_us > 0 && ++connection.acknowledge_owed < Delayed_acknowledge_limit)
+		{
+			if (connection.acknowledge_owed == 1) delay_acknowledge(shard, connection);
+			return;
+		}
+
+		if (!connection.acknowledge_pending)
+		{
+			connection.acknowledge_pending = true;
+			shard.pending_acknowledges.push_back(connection.handle);
+		}
+	}
+
+	// delivers the newest sequenced package, never acknowledged
+	void process_sequenced(Shard& shard, Connection& connection, const Address& address, const Package_view& package)
+	{
+		if (sequence_before(package.number, connection.sequenced_receive))
+		{
+			++shard.sequenced_stale;
+			if (config.trace) printf("Dropping sequenced package #%u, newer one already delivered\n", package.number);
+			return;
+		}
+		if (shard.message_queue.size() >= shard.message_queue.capacity())
+		{
+			++shard.sequenced_overflows;
+			++shard.message_queue_overflows;
+			return;
+		}
+
+		connection.sequenced_receive = package.number + 1;
+		push_message(shard, address, std::string(package.payload, package.length));
+	}
+
+	void delay_acknowledge(Shard& shard, Connection& connection)
+	{
+		connection.acknowledge_due_us = monotonic_us() + config.acknowledge_delay_us;
+		shard.delayed_acknowledges.push_back(connection.handle);
+		if (shard.acknowledge_deadline_us == 0 || connection.acknowledge_due_us < shard.acknowledge_deadline_us)
+		{
+			shard.acknowledge_deadline_us = connection.acknowledge_due_us;
+		}
+		schedule_earlier(shard, connection.acknowledge_due_us);
+	}
+
+	// sends the delayed acknowledges that came due and were not carried by data, keeps the earliest of the rest
+	void flush_delayed_acknowledges(Shard& shard, Time now_us)
+	{
+		shard.acknowledge_deadline_us = 0;
+
+		int32 kept = 0;
+		for (Connection_handle handle : shard.delayed_acknowledges)
+		{
+			Connection& connection = shard.connections.get(handle);
+			if (connection.acknowledge_owed == 0) continue;
+
+			if (connection.acknowledge_due_us <= now_us)
+			{
+				send_acknowledge(shard, connection);
+				continue;
+			}
+
+			shard.delayed_acknowledges[kept++] = handle;
+			if (shard.acknowledge_deadline_us == 0 || connection.acknowledge_due_us < shard.acknowledge_deadline_us)
+			{
+				shard.acknowledge_deadline_us = connection.acknowledge_due_us;
+			}
+		}
+		shard.delayed_acknowledges.resize(kept);
+	}
+
+	void push_message(Shard& shard, const Address& address, std::string&& message)
+	{
+		Input_message input;
+		input.address = address;
+		input.message = std::move(message);
+		// pushes are serialized by shard.mutex, callers check the capacity first
+		shard.message_queue.try_push(std::move(input));
+		shard.message_queue_high_water = std::max(shard.message_queue_high_water, shard.message_queue.size());
+		notify_message();
+	}
+
+	// queues a whole message, or collects a fragment until the last one completes it, and moves its stream on
+	void accept_package(Shard& shard, Connection& connection, const Address& address, const Package_view& package)
+	{
+		if (package.type == Package_type::Unordered)
+		{
+			push_message(shard, address, std::string(package.payload, package.length));
+			return;
+		}
+
+		Stream_state& stream = connection.stream(package.stream);
+		++stream.next_receive;
+
+		Reassembly& reassembly = stream.reassembly;
+		bool fragment = package.type == Package_type::Fragment;
+		if (!fragment && reassembly.data.empty() && !reassembly.discarding)
+		{
+			push_message(shard, address, std::string(package.payload, package.length));
+			return;
+		}
+
+		if (!reassembly.discarding)
+		{
+			if (reassembly.data.size() + package.length > config.message_limit)
+			{
+				++shard.reassembly_drops;
+				if (config.trace) printf("Dropping message from %s, longer than %d bytes\n", address.to_string().c_str(), config.message_limit);
+				discard_reassembly(shard, reassembly);
+			}
+			else
+			{
+				reassembly.last_ms = monotonic_ms();
+				if (reassembly.data.empty())
+				{
+					Time expires = reassembly.last_ms + config.reassembly_timeout_ms;
+					reassembly.timer = shard.retransmit_timers.arm(reassembly.last_ms, expires, Reassembly_tag | retransmit_tag(connection.handle, package.stream));
+					schedule_earlier(shard, expires * 1000);
+				}
+				reassembly.data.append(package.payload, package.length);
+				shard.reassembly_bytes += package.length;
+			}
+		}
+
+		if (fragment) return;
+		if (reassembly.discarding)
+		{
+			reassembly.discarding = false;
+			return;
+		}
+
+		shard.retransmit_timers.cancel(reassembly.timer);
+		reassembly.timer = -1;
+		shard.reassembly_bytes -= reassembly.data.size();
+		std::string message;
+		message.swap(reassembly.data);
+		push_message(shard, address, std::move(message));
+	}
+
+	void discard_reassembly(Shard& shard, Reassembly& reassembly)
+	{
+		if (reassembly.timer >= 0) shard.retransmit_timers.cancel(reassembly.timer);
+		reassembly.timer = -1;
+		shard.reassembly_bytes -= reassembly.data.size();
+		std::string().swap(reassembly.data);
+		reassembly.discarding = true;
+	}
+
+	// fired from the timer wheel, re-arms while fragments keep arriving
+	void expire_reassembly(Shard& shard, Connection& connection, int32 stream, Time now)
+	{
+		Reassembly& reassembly = connection.stream(stream).reassembly;
+		reassembly.timer = -1;
+		if (reassembly.data.empty()) return;
+
+		Time expires = reassembly.last_ms + config.reassembly_timeout_ms;
+		if (now < expires)
+		{
+			reassembly.timer = shard.retransmit_timers.arm(now, expires, Reassembly_tag | retransmit_tag(connection.handle, stream));
+			return;
+		}
+
+		++shard.reassembly_timeouts;
+		if (config.trace) printf("Dropping partial message from %s, no fragment within timeout\n", connection.address.to_string().c_str());
+		discard_reassembly(shard, reassembly);
+	}
+
+	// moves the held run starting at number_receive into the message queue
+	void deliver_held(Shard& shard, Connection& connection, const Address& address)
+	{
+		Reorder_window& reorder = connection.reorder;
+		while (reorder.holds(0))
+		{
+			if (reorder.delivered & 1)
+			{
+				reorder.advance(shard.packets, connection.number_receive);
+				--shard.reorder_held;
+				++connection.number_receive;
+				continue;
+			}
+			if (shard.message_queue.size() >= shard.message_queue.capacity())
+			{
+				// stays held until the application pops a message
+				++shard.message_queue_overflows;
+				if (config.trace) printf("Holding package #%u, message queue is full\n", connection.number_receive);
+				if (!reorder.stalled)
+				{
+					reorder.stalled = true;
+					shard.stalled_connections.push_back(connection.handle);
+					shard.delivery_stalled.store(true, std::memory_order_release);
+				}
+				break;
+			}
+
+			accept_package(shard, connection, address, reorder.view(shard.packets, connection.number_receive));
+			reorder.advance(shard.packets, connection.number_receive);
+			--shard.reorder_held;
+			++connection.number_receive;
+		}
+	}
+
+	// after a stream moved on past a gap, delivers its held packages that are next in turn
+	void deliver_stream(Shard& shard, Connection& connection, const Address& address, int32 stream)
+	{
+		Reorder_window& reorder = connection.reorder;
+		for (uint64 bits = reorder.held & ~reorder.delivered; bits != 0; bits &= bits - 1)
+		{
+			int32 offset = __builtin_ctzll(bits);
+			Package_view held = reorder.view(shard.packets, connection.number_receive + offset);
+			// packages sent before the stream header only go in number order
+			if (!held.streamed && stream == 0) break;
+			if (!held.streamed || held.stream != stream) continue;
+			if (held.stream_sequence != connection.stream(stream).next_receive) break;
+			if (shard.message_queue.size() >= shard.message_queue.capacity()) break;
+
+			accept_package(shard, connection, address, held);
+			reorder.mark_delivered(shard.packets, held.number, offset);
+			++shard.stream_early;
+		}
+	}
+
+	// called by the consumer once it made room in the message queue
+	void resume_delivery(Shard& shard)
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		shard.delivery_stalled.store(false, std::memory_order_relaxed);
+
+		std::vector<Connection_handle> stalled;
+		stalled.swap(shard.stalled_connections);
+		for (Connection_handle handle : stalled)
+		{
+			Connection& connection = shard.connections.get(handle);
+			connection.reorder.stalled = false;
+			Package_number before = connection.number_receive;
+			deliver_held(shard, connection, connection.address);
+			if (connection.number_receive != before && !connection.acknowledge_pending)
+			{
+				connection.acknowledge_pending = true;
+				shard.pending_acknowledges.push_back(handle);
+			}
+		}
+		flush_acknowledges(shard);
+	}
+
+	// one acknowledge per peer for the whole receive batch
+	void flush_acknowledges(Shard& shard)
+	{
+		for (Connection_handle handle : shard.pending_acknowledges)
+		{
+			Connection& connection = shard.connections.get(handle);
+			connection.acknowledge_pending = false;
+			send_acknowledge(shard, connection);
+		}
+		shard.pending_acknowledges.clear();
+	}
+
+	static constexpr int32 Acknowledge_size = Package_view::Header_size + sizeof(uint64);
+
+	// returns the bytes written, Acknowledge_size
+	int32 write_acknowledge(Connection& connection, char* buffer)
+	{
+		// covers whatever a delayed acknowledge still owed
+		connection.acknowledge_owed = 0;
+
+		uint64 mask = htole64(receive_mask(connection));
+
+		Package_view package_ack;
+		package_ack.type = Package_type::Acknowledge;
+		package_ack.number = connection.number_receive;
+		package_ack.payload = (const char*)&mask;
+		package_ack.length = sizeof(mask);
+		return package_ack.serialize(buffer);
+	}
+
+	void send_acknowledge(Shard& shard, Connection& connection)
+	{
+		char buffer[Acknowledge_size];
+		int32 size = write_acknowledge(connection, buffer);
+		send_serialized(shard, connection, buffer, size);
+		++shard.acknowledges_sent;
+	}
+
+	// bit i stands for package number_receive + 1 + i
+	uint64 receive_mask(const Connection& connection)
+	{
+		return connection.reorder.held >> 1;
+	}
+
+	void process_acknowledge(Shard& shard, Connection& connection, const Package_view& package)
+	{
+		Package_number cumulative = package.number;
+		uint64 mask = 0;
+		if (package.length >= sizeof(mask)) bcopy(package.payload, &mask, sizeof(mask));
+		mask = le64toh(mask);
+
+		Time now_us = monotonic_us();
+		Time rtt_us = 0;
+		bool sampled = false;
+		int32 cleared = 0;
+
+		Send_ring& sessions = connection.send_sessions;
+		auto clear = [&](Package_number number)
+		{
+			Send_session* session = sessions.find(number);
+			if (!session) return;
+
+			shard.retransmit_timers.cancel(session->timer);
+			shard.packets.release(session->buffer);
+			// Karn: an acknowledge for a retransmitted package can belong to any copy, the newest clean one is sampled
+			if (session->retransmits == 0)
+			{
+				rtt_us = now_us - session->sent_us;
+				sampled = true;
+			}
+			sessions.remove(number);
+			++cleared;
+		};
+
+		// an acknowledge past next() is bogus, the ring empties before the loop would run away
+		while (sessions.size() > 0 && sequence_before(sessions.oldest(), cumulative)) clear(sessions.oldest());
+		for (uint64 bits = mask; bits != 0; bits &= bits - 1)
+		{
+			clear(cumulative + 1 + __builtin_ctzll(bits));
+		}
+
+		if (sampled) connection.rtt.sample(rtt_us, config.rto_min_ms, config.rto_max_ms);
+		if (cleared > 0) connection.congestion->on_acknowledge(cleared, sampled ? rtt_us : 0);
+
+		if (cleared == 0)
+		{
+			if (config.trace) printf("No package to acknowledge below #%u\n", cumulative);
+		}
+		else
+		{
+			if (config.trace) printf("Acknowledged %d packages below #%u\n", cleared, cumulative);
+			release_send_queue(shard, connection);
+		}
+	}
+
+	// expects shard.mutex to be held and room in the send window
+	void transmit(Shard& shard, Connection& connection, Send_session session)
+	{
+		session.number = connection.number_send;
+		Package_view::renumber(shard.packets.data(session.buffer), session.number);
+
+		if (debug_disable_next_immediate_send)
+		{
+			debug_disable_next_immediate_send = false;
+		}
+		else
+		{
+			send_package(shard, connection, session);
+		}
+		session.sent_us = monotonic_us();
+		session.timer = arm_retransmit(shard, connection, session.number, session.sent_us / 1000);
+		connection.send_sessions.push(session);
+
+		++connection.number_send;
+	}
+
+	int32 send_limit(const Connection& connection)
+	{
+		if (connection.handshake == Handshake::Hello) return 0;
+		return std::min(config.send_window, connection.congestion->window());
+	}
+
+	// moves queued messages into the send window as acknowledges free it
+	void release_send_queue(Shard& shard, Connection& connection)
+	{
+		while (!connection.send_queue.empty() && connection.send_sessions.span() < send_limit(connection))
+		{
+			transmit(shard, connection, connection.send_queue.front());
+			connection.send_queue.pop_front();
+		}
+
+		if (connection.send_blocked && connection.send_queue.empty())
+		{
+			connection.send_blocked = false;
+			shard.send_ready.push_back(connection.address);
+			shard.send_ready_pending.store(true, std::memory_order_release);
+			notify_message(true);
+		}
+	}
+
+	bool send_package(Shard& shard, Connection& connection, const Send_session& session)
+	{
+		return send_package(shard, connection, shard.packets.data(session.buffer), session.size);
+	}
+
+	bool send_package(Shard& shard, Connection& connection, const char* serialized, int32 size)
+	{
+		bool echo = connection.handshake == Handshake::Echo;
+		if (connection.acknowledge_owed == 0 && !echo) return send_serialized(shard, connection, serialized, size);
+
+		char buffer[Datagram_limit];
+		int32 sz = 0;
+		// any of these datagrams can be the one that gets the connection admitted
+		if (echo)
+		{
+			Package_view package;
+			package.type = Package_type::Cookie;
+			package.payload = (const char*)&connection.cookie;
+			package.length = sizeof(connection.cookie);
+			sz += package.serialize(buffer);
+		}
+		// an owed acknowledge rides in front of the data in the same datagram
+		if (connection.acknowledge_owed > 0)
+		{
+			sz += write_acknowledge(connection, buffer + sz);
+			++shard.acknowledges_piggybacked;
+		}
+		bcopy(serialized, buffer + sz, size);
+		return send_serialized(shard, connection, buffer, sz + size);
+	}
+
+	// sent once outside the send window, nothing is kept for it
+	// the connection should be past the Hello state
+	void send_sequenced(Shard& shard, Connection& connection, const std::string& message)
+	{
+		Package_view package;
+		package.number = connection.sequenced_send++;
+		package.type = Package_type::Sequenced;
+		package.payload = message.data();
+		package.length = message.size();
+
+		char buffer[Datagram_limit];
+		int32 size = package.serialize(buffer);
+		send_package(shard, connection, buffer, size);
+		if (shard.uring.opened()) shard.uring.submit();
+		++shard.sequenced_sent;
+	}
+
+	bool send_serialized(Shard& shard, Connection& connection, const char* buffer, int32 size)
+	{
+		if (config.coalesce_us > 0)
+		{
+			coalesce(shard, connection, buffer, size);
+			return true;
+		}
+		return send_datagram(shard, connection.address.addr, buffer, size);
+	}
+
+	// appends to the peer's pending datagram, sending it first when the package would not fit
+	void coalesce(Shard& shard, Connection& connection, const char* buffer, int32 size)
+	{
+		auto& pending = connection.coalesced;
+		if (!pending.empty() && pending.size() + size > Datagram_limit) send_coalesced(shard, connection);
+
+		if (pending.empty())
+		{
+			connection.coalesce_started_us = monotonic_us();
+			Time deadline = connection.coalesce_started_us + config.coalesce_us;
+			if (!connection.coalesce_listed)
+			{
+				connection.coalesce_listed = true;
+				shard.coalescing.push_back(connection.handle);
+			}
+			if (shard.coalesce_deadline_us == 0 || deadline < shard.coalesce_deadline_us) shard.coalesce_deadline_us = deadline;
+			schedule_earlier(shard, deadline);
+		}
+		pending.insert(pending.end(), buffer, buffer + size);
+		++shard.coalesced_packages;
+	}
+
+	void send_coalesced(Shard& shard, Connection& connection)
+	{
+		send_datagram(shard, connection.address.addr, connection.coalesced.data(), connection.coalesced.size());
+		connection.coalesced.clear();
+		++shard.coalesced_datagrams;
+	}
+
+	// sends the pending datagrams whose deadline passed, keeps the earliest of the rest
+	void flush_coalesced(Shard& shard, Time now_us)
+	{
+		shard.coalesce_deadline_us = 0;
+
+		int32 kept = 0;
+		for (Connection_handle handle : shard.coalescing)
+		{
+			Connection& connection = shard.connections.get(handle);
+			if (connection.coalesced.empty())
+			{
+				connection.coalesce_listed = false;
+				continue;
+			}
+
+			Time deadline = connection.coalesce_started_us + config.coalesce_us;
+			if (deadline <= now_us)
+			{
+				send_coalesced(shard, connection);
+				connection.coalesce_listed = false;
+				continue;
+			}
+
+			shard.coalescing[kept++] = handle;
+			if (shard.coalesce_deadline_us == 0 || deadline < shard.coalesce_deadline_us) shard.coalesce_deadline_us = deadline;
+		}
+		shard.coalescing.resize(kept);
+	}
+
+	bool send_datagram(Shard& shard, const sockaddr_in& target, const char* buffer, int32 size)
+	{
+		if (shard.link.enabled())
+		{
+			if (shard.link.push(monotonic_us(), target, buffer, size))
+			{
+				schedule_earlier(shard, shard.link.next_release_us());
+			}
+			// a dropped datagram looks sent, like on a real link
+			return true;
+		}
+
+		if (shard.uring.opened() && !shard.uring_free_sends.empty())
+		{
+			io_uring_sqe* sqe = shard.uring.next_sqe();
+			if (sqe)
+			{
+				int32 slot = shard.uring_free_sends.back();
+				shard.uring_free_sends.pop_back();
+
+				Uring_slot& send = shard.uring_sends[slot];
+				send.addr = target;
+				bcopy(buffer, send.buffer, size);
+				send.prepare(size);
+
+				sqe->opcode = IORING_OP_SENDMSG;
+				sqe->fd = shard.socket;
+				sqe->addr = (uint64)&send.header;
+				sqe->user_data = Uring_send_tag | slot;
+				// submitted with the next io_uring_enter of whoever queued it
+				return true;
+			}
+		}
+
+		int32 send_result = sendto(shard.socket, buffer, size, 0, (const sockaddr*)(&target), sizeof(target));
+		if (send_result <= 0)
+		{
+			printf("Failed to send a package to %s\n", Address(target).to_string().c_str());
+			return false;
+		}
+		return true;
+	}
+
+	void post_uring_slots(Shard& shard)
+	{
+		// the rest of the queue is left for sends
+		shard.uring_receive_depth = std::min<int32>(config.receive_batch_size, Uring_queue_depth / 2);
+		shard.uring_receives.reset(new Uring_slot[shard.uring_receive_depth]);
+		for (int32 i = 0; i < shard.uring_receive_depth; ++i) post_receive(shard, i);
+
+		shard.uring_sends.reset(new Uring_slot[Uring_send_slots]);
+		for (int32 i = Uring_send_slots - 1; i >= 0; --i) shard.uring_free_sends.push_back(i);
+	}
+
+	void post_receive(Shard& shard, int32 slot)
+	{
+		Uring_slot& receive = shard.uring_receives[slot];
+		receive.prepare(sizeof(receive.buffer));
+
+		io_uring_sqe* sqe = shard.uring.next_sqe();
+		if (!sqe)
+		{
+			// sends filled the queue, handing them to the kernel frees their entries
+			shard.uring.submit();
+			sqe = shard.uring.next_sqe();
+		}
+		if (!sqe)
+		{
+			shard.uring_unposted.push_back(slot);
+			++shard.uring_post_retries;
+			return;
+		}
+		sqe->opcode = IORING_OP_RECVMSG;
+		sqe->fd = shard.socket;
+		sqe->addr = (uint64)&receive.header;
+		sqe->user_data = slot;
+	}
+
+	void listen_uring(Shard& shard)
+	{
+		while (!terminated)
+		{
+			uint32 count;
+			{
+				std::lock_guard<std::mutex> _(shard.mutex);
+				count = shard.uring.take_pending();
+			}
+			// receives re-posted and acknowledges queued by the last batch go out with this wait
+			int32 result = shard.uring.enter(count, 1);
+			if (result < 0 && errno != EINTR) break;
+
+			if (reap_uring(shard) < 0 || terminated) break;
+		}
+	}
+
+	// handles every completion available, returns the number of datagrams or -1 once the socket is gone
+	int32 reap_uring(Shard& shard)
+	{
+		std::lock_guard<std::mutex> _(shard.mutex);
+
+		int32 received = 0;
+		bool closed = false;
+		std::vector<int32> unposted;
+		unposted.swap(shard.uring_unposted);
+		for (int32 slot : unposted) post_receive(shard, slot);
+
+		while (io_uring_cqe* cqe = shard.uring.peek())
+		{
+			uint64 tag = cqe->user_data;
+			int32 result = cqe->res;
+			shard.uring.advance();
+
+			if (tag & Uring_send_tag)
+			{
+				int32 slot = tag & ~Uring_send_tag;
+				if (result <= 0)
+				{
+					printf("Failed to send a package to %s\n", Address{ shard.uring_sends[slot].addr }.to_string().c_str());
+				}
+				shard.uring_free_sends.push_back(slot);
+				continue;
+			}
+
+			// an empty datagram completes with 0 like a shut down socket, only terminate tells them apart
+			int32 slot = tag;
+			if (terminated || result == -ECANCELED || result == -EBADF)
+			{
+				closed = true;
+				continue;
+			}
+			if (result < 0)
+			{
+				post_receive(shard, slot);
+				continue;
+			}
+
+			// completions are reaped under the lock that send slots need anyway, one lock per reap however many are dropped
+			if (!rate_limited(shard, shard.uring_receives[slot].addr))
+			{
+				process_datagram(shard, shard.uring_receives[slot].addr, shard.uring_receives[slot].buffer, result);
+			}
+			++received;
+			post_receive(shard, slot);
+		}
+
+		if (received > 0)
+		{
+			flush_acknowledges(shard);
+			++shard.receive_batch_histogram[std::min(received, shard.uring_receive_depth)];
+		}
+		return closed ? -1 : received;
+	}
+
+	// a single load when nobody waits
+	void notify_message(bool force = false)
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!force && message_waiters.load(std::memory_order_relaxed) == 0) return;
+
+		std::lock_guard<std::mutex> _(message_wait_mutex);
+		message_wait.notify_all();
+	}
+
+	void wake()
+	{
+		uint64 one = 1;
+		write(wake_fd, &one, sizeof(one));
+	}
+
+	Address address_server;
+	int32 wake_fd{ -1 };
+
+	bool is_server{ false };
+
+	Server_config config;
+	// keys the handshake cookies, drawn at start
+	uint64 cookie_key[2]{};
+
+	std::atomic<bool> terminated{ false };
+
+	std::vector<std::unique_ptr<Shard>> shards;
+	int32 next_shard{ 0 };
+
+	std::mutex message_wait_mutex;
+	std::condition_variable message_wait;
+	std::atomic<int32> message_waiters{ 0 };
 
 	enum class State
 	{
@@ -527,5 +4124,5 @@ private:
 		Started,
 		Terminated
 	};
-	State state{ State::None };
+	std::atomic<State> state{ State::None };
 };
@@ -8,6 +8,10 @@ constexpr char* Login_file = "logins.txt";
 
 constexpr int32 Header_length = 16;
 constexpr int32 Name_limit = 64;
+// replies held per client while its send queue is full
+constexpr int32 Outbox_limit = 64;
+// listings and letters can be long, a lost one should not hold up the short replies on stream 0
+constexpr int32 Letter_stream = 1;
 
 
 struct Mail_box
@@ -21,6 +25,12 @@ struct Mail_user
 	std::string username;
 };
 
+struct Mail_reply
+{
+	std::string message;
+	int32 stream{ 0 };
+};
+
 class Mail
 {
 public:
@@ -178,32 +188,32 @@ public:
 			{
 				if (second.size() == 0 || second.size() > Name_limit)
 				{
-					server.send(from, "Bad name: " + second);
+					reply(from, "Bad name: " + second);
 					return;
 				}
 
 
 				if (logged)
 				{
-					server.send(from, "Already logged in as: " + name);
+					reply(from, "Already logged in as: " + name);
 					return;
 				}
 
 				logged = mail.login(from, second);
 				if (!logged)
 				{
-					server.send(from, "Failed to log in as: " + second);
+					reply(from, "Failed to log in as: " + second);
 					return;
 				}
 
-				server.send(from, "Logged in as: " + second);
+				reply(from, "Logged in as: " + second);
 				return;
 			}
 		}
 
 		if (!logged)
 		{
-			server.send(from, "Please log in");
+			reply(from, "Please log in");
 			return;
 		}
 
@@ -212,7 +222,7 @@ public:
 			auto first = tokens[0];
 			if (first == "LIST")
 			{
-				server.send(from, mail.list_messages(name));
+				reply(from, mail.list_messages(name), Letter_stream);
 				return;
 			}
 		}
@@ -227,22 +237,22 @@ public:
 				std::string message;
 				if (!mail.read_message(name, std::stoi(second), message))
 				{
-					server.send(from, "Letter not found");
+					reply(from, "Letter not found");
 					return;
 				}
 
-				server.send(from, message);
+				reply(from, message, Letter_stream);
 				return;
 			}
 			if (first == "DELETE")
 			{
 				if (!mail.delete_message(name, std::stoi(second)))
 				{
-					server.send(from, "Letter not found");
+					reply(from, "Letter not found");
 					return;
 				}
 
-				server.send(from, "Deleted successfully");
+				reply(from, "Deleted successfully");
 				return;
 			}
 		}
@@ -257,18 +267,77 @@ public:
 			{
 				if (!mail.send_message(name, second, third))
 				{
-					server.send(from, "Failed to send message");
+					reply(from, "Failed to send message");
 					return;
 				}
-				server.send(from, "Message sent");
+				reply(from, "Message sent");
 				return;
 			}
 		}
-		server.send(from, "Unexpected package");
+		reply(from, "Unexpected package");
 		printf("Unexpected package received from %s: %s\n", from.to_string().c_str(), message.c_str());
 	}
 
+	// retries replies held back by a full send queue, in order per client
+	void flush(const Address& to)
+	{
+		for (auto it = outbox.begin(); it != outbox.end(); ++it)
+		{
+			if (it->first != to) continue;
+
+			auto& replies = it->second;
+			while (!replies.empty() && server.send(to, replies.front().message, Delivery::Reliable_ordered, replies.front().stream) != Send_result::Would_block)
+			{
+				replies.pop_front();
+			}
+			if (replies.empty()) outbox.erase(it);
+			return;
+		}
+	}
+
+	// replies held for a client whose connection was evicted would never go out
+	void prune()
+	{
+		for (auto it = outbox.begin(); it != outbox.end();)
+		{
+			if (server.connected(it->first))
+			{
+				++it;
+				continue;
+			}
+			printf("Dropping %d replies to %s, the connection is gone\n", (int32)it->second.size(), it->first.to_string().c_str());
+			it = outbox.erase(it);
+		}
+	}
+
 private:
+	void reply(const Address& to, std::string message, int32 stream = 0)
+	{
+		for (auto& entry : outbox)
+		{
+			if (entry.first != to) continue;
+
+			if (entry.second.size() >= Outbox_limit)
+			{
+				printf("Dropping reply to %s, outbox is full\n", to.to_string().c_str());
+				return;
+			}
+			entry.second.push_back(Mail_reply{ message, stream });
+			return;
+		}
+
+		Send_result result = server.send(to, message, Delivery::Reliable_ordered, stream);
+		if (result == Send_result::Would_block)
+		{
+			outbox.emplace_back(to, std::deque<Mail_reply>{ Mail_reply{ message, stream } });
+		}
+		else if (result == Send_result::Too_large)
+		{
+			printf("Dropping reply to %s, %d bytes is over the message limit\n", to.to_string().c_str(), (int32)message.size());
+		}
+	}
+
 	Server & server;
 	Mail& mail;
+	std::vector<std::pair<Address, std::deque<Mail_reply>>> outbox;
 };
\ No newline at end of file
@@ -1,7 +1,7 @@
 #include "common.h"
 #include "mail.h"
 
-constexpr const char* Available_commands = "Available commands:\nlist\nban <slot>\nexit\n";
+constexpr const char* Available_commands = "Available commands:\nlist\nban <slot>\nstats\nexit\n";
 
 void master(Server& server)
 {
@@ -19,6 +19,11 @@ void master(Server& server)
 			std::string list = server.get_clients();
 			printf("Current connections:\n%s", list.c_str());
 		}
+		else if (command == "stats")
+		{
+			std::string stats = server.get_stats();
+			printf("%s", stats.c_str());
+		}
 		else if (command.find("ban") != std::string::npos)
 		{
 			int32 number = std::stoi(command.substr(4, command.size() - 4));
@@ -40,40 +45,99 @@ void master(Server& server)
 	}
 }
 
+void handle(Mail_processor& processor, const Input_message& message)
+{
+	std::string str = "Received " + message.message + " from " + message.address.to_string() + "\n";
+	printf(str.c_str());
+
+	processor.process(message.message, message.address);
+}
+
+void flush_ready(Server& server, Mail_processor& processor)
+{
+	processor.prune();
+
+	Address ready[16];
+	int32 count;
+	while ((count = server.send_ready(ready, 16)) > 0)
+	{
+		for (int32 i = 0; i < count; ++i) processor.flush(ready[i]);
+	}
+}
+
 void logic(Server& server, Mail_processor& processor)
 {
 	while (server.running())
 	{
-		if (server.has_message())
+		// wakes at least once a second, so replies for evicted clients are dropped without traffic
+		bool has_message = server.wait_message(Time{ 1000 });
+		flush_ready(server, processor);
+		if (has_message)
 		{
-			auto message = server.next_message();
-			std::string str = "Received " + std::string(message.message.message) + " from " + message.address.to_string() + "\n";
-			printf(str.c_str());
-
-			processor.process(message.message.message, message.address);
+			handle(processor, server.next_message());
 		}
-
-		server.wait_ms(Time{ 50 });
 	}
 }
 
 int main(int argc, char* argv[])
 {
+	Server_config config;
+	if (!parse_arguments(argc, argv, config)) return 1;
+
 	Server server;
-	server.start(true);
+	server.start(true, config);
 	Mail mail;
 	Mail_processor processor{ server, mail };
 
-	std::thread listen_thread([&] {server.listen_thread(); });
-	std::thread resend_thread([&] {server.resend_thread(); });
+	if (config.event_loop)
+	{
+		// shards dispatch concurrently, the mail state is not shared safely
+		std::mutex processor_mutex;
+		auto dispatch = [&](const Input_message& message)
+		{
+			std::lock_guard<std::mutex> _(processor_mutex);
+			flush_ready(server, processor);
+			handle(processor, message);
+		};
+		// replies queued on Letter_stream go out as soon as acknowledges make room, not on the next request
+		auto ready = [&]()
+		{
+			std::lock_guard<std::mutex> _(processor_mutex);
+			flush_ready(server, processor);
+		};
+
+		std::vector<std::thread> shard_threads;
+		for (int32 i = 1; i < server.shard_count(); ++i)
+		{
+			shard_threads.emplace_back([&, i] {server.event_loop(dispatch, i, ready); });
+		}
+		std::thread master_thread([&] {master(server); });
+		printf(Available_commands);
+
+		server.event_loop(dispatch, 0, ready);
+
+		for (auto& thread : shard_threads) thread.join();
+		master_thread.join();
+
+		printf("Press any key to exit...");
+		std::cin.get();
+
+		return 0;
+	}
+
+	std::vector<std::thread> network_threads;
+	for (int32 i = 0; i < server.shard_count(); ++i)
+	{
+		network_threads.emplace_back([&, i] {server.listen_thread(i); });
+		network_threads.emplace_back([&, i] {server.resend_thread(i); });
+	}
 	std::thread logic_thread([&] {logic(server, processor); });
 	std::thread master_thread([&] {master(server); });
 	printf(Available_commands);
 
 	// server.debug_drop_next_input_package = true;
 
-	listen_thread.join();
-	resend_thread.join();
+	for (auto& thread : network_threads) thread.join();
 	logic_thread.join();
 	master_thread.join();
 
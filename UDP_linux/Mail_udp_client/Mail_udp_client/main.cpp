@@ -81,34 +81,66 @@ void master(Server& server)
 				continue;
 			}
 
-			Address address;
-			address.hostname = "127.0.0.1";
-			address.port = Network_port;
-			server.send(address, protocol_command);
+			Address address{ "127.0.0.1", Network_port };
+			if (server.send(address, protocol_command) == Send_result::Would_block)
+			{
+				printf("Server is not keeping up, message dropped\n");
+			}
 		}
 
 	}
 }
 
+void handle(const Input_message& message)
+{
+	// std::string str = "Received " + message.message + " from " + message.address.to_string() + "\n";
+	std::cout << message.message << "\n";
+}
+
+void report_ready(Server& server)
+{
+	Address ready;
+	while (server.send_ready(&ready, 1) > 0)
+	{
+		printf("Server is keeping up again\n");
+	}
+}
+
 void logic(Server& server)
 {
 	while (server.running())
 	{
-		if (server.has_message())
+		bool has_message = server.wait_message(Time{ 1000 });
+		report_ready(server);
+		if (has_message)
 		{
-			auto message = server.next_message();
-			// std::string str = "Received " + std::string(message.message.message) + " from " + message.address.to_string() + "\n";
-			std::cout << message.message.message << "\n";
+			handle(server.next_message());
 		}
-
-		server.wait_ms(Time{ 50 });
 	}
 }
 
 int main(int argc, char* argv[])
 {
+	Server_config config;
+	if (!parse_arguments(argc, argv, config)) return 1;
+
 	Server server;
-	server.start(false);
+	server.start(false, config);
+
+	if (config.event_loop)
+	{
+		std::thread master_thread([&] {master(server); });
+		printf(Available_commands);
+
+		server.event_loop(handle, 0, [&] { report_ready(server); });
+
+		master_thread.join();
+
+		printf("Press any key to exit...");
+		std::cin.get();
+
+		return 0;
+	}
 
 	std::thread listen_thread([&] {server.listen_thread(); });
 	std::thread resend_thread([&] {server.resend_thread(); });